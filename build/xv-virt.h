@@ -0,0 +1,218 @@
+/* XV virtualization state */
+/* Copyright (C) 2013, Spencer Tipping */
+/* Released under the terms of the GPLv3: http://www.gnu.org/licenses/gpl-3.0.txt */
+
+/* Introduction. */
+/* These definitions maintain the current virtualization state, which includes */
+/* things like keeping track of xv and application pages, managing hooks, and the */
+/* translation cache. This is also where we define the semantics for moving xv */
+/* from one location to another. */
+
+#ifndef XV_VIRT_H
+#define XV_VIRT_H
+
+/* Virtualization state structure. */
+/* All of xv's runtime state is linked into one structure, which gives us a couple */
+/* of very important properties. First, it means we have an upper bound over the */
+/* space of xv-visible state -- including the execution stack. Second, as a */
+/* consequence of this, it means we can define a garbage collect-by-copy */
+/* operation, which allows us to use heap-style allocation. */
+
+/* As usual, there's some subtlety with this. First of all, the execution stack is */
+/* inside the relocatable space, but it contains absolute addresses to xv-code */
+/* that will itself be relocated. This means we need to patch up the return */
+/* addresses when relocation happens. [1] */
+
+/* Second, we need to reset various xv-external state when we relocate the memory. */
+/* Specifically, xv installs traps and a system-call entry point in an executable */
+/* memory page that also contains the virtualization state structure. This page is */
+/* referenced only from the translation cache, which is also relocatable and is */
+/* discarded each time xv moves (since the translated code might contain */
+/* %rip-relative addresses). */
+
+#include <elf.h>
+#include <linux/errno.h>
+#include <sys/syscall.h>
+
+#include "xv.h"
+#include "xv-x64.h"
+
+typedef struct xv_virt xv_virt;
+
+/* Translation cache bounds. */
+/* The cache never grows: when it fills up, it keeps the blocks that have run */
+/* lately and retranslates them (see "Eviction" in xv-x64.h). That needs block */
+/* counters, so we always turn them on. The threshold also controls how soon hot */
+/* paths become traces. */
+
+/* Other threads get smaller caches, so that the table and the arenas have room */
+/* for XV_VIRT_MAX_THREADS of them: 64 of 4MB fit comfortably within reach of */
+/* the program's code. More threads than that still get caches (see "Threads" in */
+/* xv-x64.h); the group just collects more often. */
+
+#define XV_VIRT_CACHE_SIZE        (32 << 20)
+#define XV_VIRT_MAX_BLOCKS        (1 << 16)
+#define XV_VIRT_THREAD_CACHE_SIZE (4 << 20)
+#define XV_VIRT_THREAD_BLOCKS     (1 << 13)
+#define XV_VIRT_MAX_THREADS       64
+#define XV_VIRT_TRACE_THRESHOLD   1000
+
+/* The table counts in caches of XV_VIRT_MAX_BLOCKS. */
+#define XV_VIRT_TABLE_CACHES \
+  (1 + XV_VIRT_MAX_THREADS * XV_VIRT_THREAD_BLOCKS / XV_VIRT_MAX_BLOCKS)
+
+struct xv_virt {
+  xv_x64_tcache tc;             /* translations of the program's code */
+};
+
+/* Start virtualizing the code in [code, code + size). The region ends up
+ * write-protected. Returns 0 or -errno. */
+static inline int xv_virt_init(xv_virt        *const v,
+                               xv_x64_const_i *const code,
+                               ssize_t         const size) {
+  int status;
+  if (status = xv_x64_tcache_init(&v->tc, code, size, XV_VIRT_CACHE_SIZE,
+                                  XV_VIRT_MAX_BLOCKS, XV_VIRT_TABLE_CACHES))
+    return status;
+  v->tc.trace_threshold   = XV_VIRT_TRACE_THRESHOLD;
+  v->tc.thread_cache_size = XV_VIRT_THREAD_CACHE_SIZE;
+  v->tc.thread_blocks     = XV_VIRT_THREAD_BLOCKS;
+  return xv_x64_tcache_protect(&v->tc);
+}
+
+/* Call this once xv has moved. Translated code calls xv's old exit receiver,
+ * and its exit records point to the old tc, so all of it has to go. */
+static inline void xv_virt_moved(xv_virt *const v) {
+  xv_x64_tcache_flush(&v->tc);
+}
+
+/* For SIGSEGV: returns 1 if the fault was a write to the program's code and
+ * has been dealt with, 0 if it was something else, or -errno. */
+static inline int xv_virt_write_fault(xv_virt    *const v,
+                                      void const *const addr) {
+  return xv_x64_tcache_write_fault(&v->tc, addr);
+}
+
+/* Translation images. */
+/* A worker that starts from the same binary as the last one can load the last */
+/* one's translations instead of making its own (see "Images" in xv-x64.h). The */
+/* key says which file the code came from: its mtime and size, then its GNU */
+/* build-id, which we find in the loaded program headers. Files without a */
+/* build-id still get a key, just a weaker one. */
+
+/* Fill key for code from an ELF file whose headers are mapped at ehdr. */
+static inline void xv_virt_image_key(Elf64_Ehdr const *const ehdr,
+                                     int64_t           const mtime,
+                                     int64_t           const size,
+                                     uint8_t          *const key) {
+  Elf64_Phdr const *const phdrs = (Elf64_Phdr const*)
+                                  ((char const*) ehdr + ehdr->e_phoff);
+  intptr_t bias = (intptr_t) ehdr;
+
+  memset(key, 0, XV_X64_IMAGE_KEY);
+  memcpy(key,     &mtime, 8);
+  memcpy(key + 8, &size,  8);
+
+  for (unsigned i = 0; i < ehdr->e_phnum; ++i)
+    if (phdrs[i].p_type == PT_LOAD) {
+      bias -= phdrs[i].p_vaddr & ~(phdrs[i].p_align - 1);
+      break;
+    }
+
+  for (unsigned i = 0; i < ehdr->e_phnum; ++i) {
+    if (phdrs[i].p_type != PT_NOTE) continue;
+    char const *      note = (char const*) (bias + phdrs[i].p_vaddr);
+    char const *const end  = note + phdrs[i].p_memsz;
+
+    while (note + sizeof(Elf64_Nhdr) <= end) {
+      Elf64_Nhdr const *const n    = (Elf64_Nhdr const*) note;
+      char       const *const name = note + sizeof(Elf64_Nhdr);
+      char       const *const desc = name + (n->n_namesz + 3 & ~3);
+
+      if (n->n_type == NT_GNU_BUILD_ID && n->n_namesz == 4
+          && name[0] == 'G' && name[1] == 'N' && name[2] == 'U'
+          && desc + n->n_descsz <= end) {
+        memcpy(key + 16, desc, n->n_descsz < XV_X64_IMAGE_KEY - 16
+                                 ? n->n_descsz
+                                 : XV_X64_IMAGE_KEY - 16);
+        return;
+      }
+      note = desc + (n->n_descsz + 3 & ~3);
+    }
+  }
+}
+
+/* Returns 0 or -errno. fd has to be a new file, which the caller rename()s
+ * over the old image once this succeeds. Never write into an image that
+ * might be loaded: loading maps its code, so workers would see the new bytes
+ * under their translations, or SIGBUS if the file got shorter. */
+static inline int xv_virt_save(xv_virt       *const v,
+                               int            const fd,
+                               uint8_t const *const key) {
+  return xv_x64_tcache_save(&v->tc, fd, key);
+}
+
+/* Call this right after xv_virt_init. Returns 0 if the image in fd loaded, 1
+ * if it's for some other code (or an xv with a different layout), or -errno. */
+static inline int xv_virt_load(xv_virt       *const v,
+                               int            const fd,
+                               uint8_t const *const key) {
+  return xv_x64_tcache_load(&v->tc, fd, key);
+}
+
+/* Statistics. */
+/* xv_virt_dump_stats writes the translation cache's counters to a file */
+/* descriptor, one per line. There's no printf, so we format them ourselves. */
+
+static inline char *xv_virt_format(char          *p,
+                                   char const    *label,
+                                   uint64_t const value) {
+  char     digits[20];
+  unsigned n = 0;
+  uint64_t x = value;
+
+  while (*label) *p++ = *label++;
+  *p++ = ' ';
+  do digits[n++] = '0' + x % 10; while (x /= 10);
+  while (n) *p++ = digits[--n];
+  *p++ = '\n';
+  return p;
+}
+
+static inline void xv_virt_dump_stats(xv_virt const *const v,
+                                      int            const fd) {
+  xv_x64_stats s;
+  char         buffer[512];
+  char        *p = buffer;
+
+  xv_x64_tcache_stats(&v->tc, &s);
+  p = xv_virt_format(p, "xv: blocks translated     ", s.blocks);
+  p = xv_virt_format(p, "xv: traces                ", s.traces);
+  p = xv_virt_format(p, "xv: translation cycles    ", s.translate_cycles);
+  p = xv_virt_format(p, "xv: cache hits            ", s.hits);
+  p = xv_virt_format(p, "xv: cache misses          ", s.misses);
+  p = xv_virt_format(p, "xv: indirect misses       ", s.indirect_misses);
+  p = xv_virt_format(p, "xv: syscalls intercepted  ", s.intercepted);
+  p = xv_virt_format(p, "xv: syscalls passed inline",
+                     s.syscalls - s.intercepted);
+  p = xv_virt_format(p, "xv: flushes               ", v->tc.flushes);
+  p = xv_virt_format(p, "xv: collections           ", v->tc.collections);
+  xv_syscall3(__NR_write, fd, (xv_register) buffer, p - buffer);
+}
+
+#endif
+
+/* Footnote 1. */
+/* It can't be done after the fact by catching segfaults. The reason is that we */
+/* would need to maintain a list of previous locations of xv, which would require */
+/* space proportional to the number of relocations; since we could relocate any */
+/* number of times, this becomes a separate GC problem in itself and therefore */
+/* requires us to parse the stack. */
+
+/* After relocating, the translation cache will be empty; so we won't have */
+/* addresses for most of the code that the stack refers to. We fix this by */
+/* rewriting the stack addresses to point to the original code, which will cause */
+/* segfaults when those returns happen. This triggers code rewriting, and */
+/* everything continues normally from there. */
+
+/* Generated by SDoc */
@@ -6,6 +6,8 @@
 /* Implementations of most of the functions in xv-x64.h; see also xv-x64-hook.s */
 /* for the assembly-language syscall intercept. */
 
+#include <asm/prctl.h>
+#include <linux/errno.h>
 #include <sys/mman.h>
 #include <sys/syscall.h>
 #include <sys/types.h>
@@ -66,8 +68,7 @@ xv_x64_insn_encoding const xv_x64_insn_encodings[1024] = {
                     XV_MODRM_NONE | XV_IMM_NONE,        /* wait */
                     R4(XV_MODRM_NONE | XV_IMM_NONE),    /* flag insns */
 
-  /* 0xa0 - 0xaf */ R2(XV_MODRM_NONE | XV_IMM_I8,       /* mov %al */
-                       XV_MODRM_NONE | XV_IMM_ISZQ),    /* mov %[re_]ax */
+  /* 0xa0 - 0xaf */ R4(XV_MODRM_NONE | XV_IMM_A64),     /* mov moffs */
                     R4(XV_MODRM_NONE | XV_IMM_NONE),    /* movs */
                     XV_MODRM_NONE | XV_IMM_I8,          /* test %al */
                     XV_MODRM_NONE | XV_IMM_ISZW,        /* test %[re_]ax */
@@ -75,10 +76,10 @@ xv_x64_insn_encoding const xv_x64_insn_encodings[1024] = {
                     R4(XV_MODRM_NONE | XV_IMM_NONE),    /* lods[b], scas[b] */
 
   /* 0xb0 - 0xbf */ R8(XV_MODRM_NONE | XV_IMM_I8),      /* movb %rxx, ib */
-                    R8(XV_MODRM_NONE | XV_IMM_ISZW),    /* mov[wlq] ... */
+                    R8(XV_MODRM_NONE | XV_IMM_ISZQ),    /* mov[wlq] ... */
 
   /* 0xc0 - 0xcf */ R2(XV_MODRM_MEM | XV_IMM_I8),       /* group2 insns */
-                    XV_MODRM_NONE | XV_IMM_ISZW,        /* ret imm */
+                    XV_MODRM_NONE | XV_IMM_I16,         /* ret imm16 */
                     XV_MODRM_NONE | XV_IMM_NONE,        /* ret */
                     R2(XV_INVALID),                     /* les, lds */
                     XV_MODRM_MEM | XV_IMM_I8,           /* movb */
@@ -96,7 +97,7 @@ xv_x64_insn_encoding const xv_x64_insn_encodings[1024] = {
                     R2(XV_INVALID),                     /* aam, aad */
                     XV_INVALID,
                     XV_MODRM_NONE | XV_IMM_NONE,        /* xlat[b_] */
-                    R8(XV_INVALID),                     /* coprocessor */
+                    R8(XV_MODRM_MEM | XV_IMM_NONE),     /* x87 */
 
   /* 0xe0 - 0xef */ R4(XV_MODRM_NONE | XV_IMM_D8),      /* loop, jcxz */
                     R4(XV_MODRM_NONE | XV_IMM_I8),      /* in/out %al, ... */
@@ -107,7 +108,7 @@ xv_x64_insn_encoding const xv_x64_insn_encodings[1024] = {
 
   /* 0xf0 - 0xff */ R4(XV_INVALID),                     /* prefixes */
                     R2(XV_MODRM_NONE | XV_IMM_NONE),    /* hlt, cmc */
-                    R2(XV_MODRM_MEM | XV_IMM_NONE),     /* group3 insns */
+                    R2(XV_MODRM_MEM | XV_IMM_NONE),     /* group3 (see below) */
                     R4(XV_MODRM_NONE | XV_IMM_NONE),    /* flags */
                     R2(XV_MODRM_NONE | XV_IMM_NONE),    /* flags */
                     R2(XV_MODRM_MEM | XV_IMM_NONE),     /* group4/5 insns */
@@ -120,7 +121,8 @@ xv_x64_insn_encoding const xv_x64_insn_encodings[1024] = {
                     R2(XV_MODRM_NONE | XV_IMM_NONE),    /* syscall, clts */
                     XV_MODRM_NONE | XV_IMM_NONE,        /* sysret */
                     R2(XV_MODRM_NONE | XV_IMM_NONE),    /* invd, wbinvd */
-                    R2(XV_INVALID),
+                    XV_INVALID,
+                    XV_MODRM_NONE | XV_IMM_NONE,        /* ud2 */
                     XV_INVALID,
                     XV_MODRM_MEM | XV_IMM_NONE,         /* prefetchw */
                     XV_INVALID,
@@ -174,7 +176,8 @@ xv_x64_insn_encoding const xv_x64_insn_encodings[1024] = {
   /* 0xc0 - 0xcf */ R2(XV_MODRM_MEM | XV_IMM_NONE),     /* xadd */
                     XV_MODRM_MEM | XV_IMM_I8,           /* vcmpxx */
                     XV_MODRM_MEM | XV_IMM_NONE,         /* movnti */
-                    R2(XV_MODRM_MEM | XV_IMM_I8),       /* SSE, AVX */
+                    R2(XV_MODRM_MEM | XV_IMM_I8),       /* pinsrw, pextrw */
+                    XV_MODRM_MEM | XV_IMM_I8,           /* shufps */
                     XV_MODRM_MEM | XV_IMM_NONE,         /* group9 insns */
                     R8(XV_MODRM_NONE | XV_IMM_NONE),    /* bswap */
 
@@ -203,6 +206,12 @@ xv_x64_insn_encoding const xv_x64_insn_encodings[1024] = {
 /* compilation output. Fortunately, rewriting should be fast enough that this */
 /* isn't a problem. */
 
+/* The translation cache doesn't use this. It carves blocks out of one arena */
+/* near the original code with a bump pointer, and it sizes each block exactly */
+/* before emitting it (see "sizing buffer" under xv_x64_write_insn). So it never */
+/* has to throw away a partial block, and it only calls mmap when the cache is */
+/* created. */
+
 /* Note that the first time you "reallocate" a buffer, it should have a zero */
 /* start-pointer. Otherwise this call will do nothing and return an error code */
 /* because it will think it couldn't free memory. You can free an ibuffer by */
@@ -267,8 +276,15 @@ int xv_x64_reallocate_ibuffer(xv_x64_ibuffer *const buf,
 #define XV_OPESC1P(x) ((x) == 0x0f)
 #define XV_OPESC2P(x) ((x) == 0x38 || (x) == 0x3a)
 
+/* Group 3 (0xf6, 0xf7) is the one case where the ModR/M reg field decides
+ * whether there's an immediate: only TEST (/0 and /1) takes one. */
+#define XV_GROUP3P(insn) \
+  ((insn)->escape == XV_INSN_ESC0 && ((insn)->opcode & 0xfe) == 0xf6 \
+                                  && !((insn)->reg & 0x06))
+
 static inline int xv_x64_immediate_bytes(xv_x64_insn const *const insn) {
   xv_x64_insn_encoding const enc = xv_x64_insn_encodings[xv_x64_insn_key(insn)];
+  if (XV_GROUP3P(insn)) return insn->opcode & 1 ? insn->p66 ? 2 : 4 : 1;
   switch (enc & XV_IMM_MASK) {
     case XV_IMM_NONE: return 0;
     case XV_IMM_D8:
@@ -281,6 +297,7 @@ static inline int xv_x64_immediate_bytes(xv_x64_insn const *const insn) {
     case XV_IMM_ISZW: return insn->p66 ? 2 : 4;
     case XV_IMM_I2:   return 3;
     case XV_IMM_ISZQ: return insn->p66 ? 2 : insn->rex_w ? 8 : 4;
+    case XV_IMM_A64:  return insn->p67 ? 4 : 8;
     default:          return 0;
   }
 }
@@ -295,12 +312,12 @@ int xv_x64_read_insn(xv_x64_const_ibuffer *const buf,
 
 #define CHECK_BOUNDS(code) \
   do { \
-    if (offset > buf->capacity) READ_ERROR(code); \
+    if (offset >= buf->capacity) READ_ERROR(code); \
   } while (0);
 
 #define INC_AND_CHECK_BOUNDS(code) \
   do { \
-    if (++offset > buf->capacity) READ_ERROR(code); \
+    if (++offset >= buf->capacity) READ_ERROR(code); \
   } while (0);
 
   xv_x64_trace(0, "xv_x64_read_insn(%x) starting\n", offset);
@@ -345,12 +362,13 @@ int xv_x64_read_insn(xv_x64_const_ibuffer *const buf,
 
   /* Now look for REX and VEX prefixes. If there are multiple (technically
    * disallowed), we will get wonky results. Also scan for XOP prefixes, which
-   * are AMD-specific and can overlap with the POP instruction. */
+   * are AMD-specific and can overlap with the POP instruction. VEX is always
+   * the last prefix, so we stop there; the next byte might look like REX. */
   CHECK_BOUNDS(ENDO1);
   for (unsigned rexp  = 0, vex2p = 0,
                 vex3p = 0, xopp  = 0, current = buf->start[offset];
 
-       offset < buf->capacity
+       offset < buf->capacity && !insn->vex && !insn->xop
          && ((rexp  =  XV_REXP(current = buf->start[offset])) ||
              (xopp  =  XV_XOPP(current, offset + 1 < buf->capacity,
                                         buf->start[offset + 1])) ||
@@ -360,6 +378,7 @@ int xv_x64_read_insn(xv_x64_const_ibuffer *const buf,
        ++offset,
        insn->vex   |= vex2p || vex3p,
        insn->xop   |= xopp,
+       insn->rex   |= rexp,
        insn->rex_w |= rexp && !!(current & 0x08),
        insn->reg   |= rexp ?   (current & 0x04) << 1 : 0,       /* REX.R */
        insn->index |= rexp ?   (current & 0x02) << 2 : 0,       /* REX.X */
@@ -389,10 +408,10 @@ int xv_x64_read_insn(xv_x64_const_ibuffer *const buf,
 
       insn->aux    =   (current & 0x78) >> 3 ^ 0x0f;    /* VEX.vvvv */
       insn->vex_l  = !!(current & 0x04);
-      insn->p66   |= current == 0x01;                   /* VEX.pp */
+      insn->p66   |= (current & 0x03) == 1;             /* VEX.pp */
       insn->p1     = (current & 0x03) == 2 ? XV_INSN_REPZ
                    : (current & 0x03) == 3 ? XV_INSN_REPNZ
-                   : insn->p2;
+                   : insn->p1;
     }
 
   xv_x64_trace(0,
@@ -400,10 +419,11 @@ int xv_x64_read_insn(xv_x64_const_ibuffer *const buf,
                offset, insn->vex, insn->rex_w, insn->vex_l);
 
   /* By this point we've read all prefixes except for opcode escapes. Now look
-   * for those. */
+   * for those; VEX and XOP already encoded them, so the next byte is always an
+   * opcode in that case. */
   CHECK_BOUNDS(ENDO2);
 
-  if (XV_OPESC1P(buf->start[offset])) {
+  if (!insn->vex && !insn->xop && XV_OPESC1P(buf->start[offset])) {
     /* We have a 0x0f prefix; now see whether we have either 0x38 or 0x3a */
     INC_AND_CHECK_BOUNDS(ENDO3);
 
@@ -441,8 +461,8 @@ int xv_x64_read_insn(xv_x64_const_ibuffer *const buf,
     unsigned reg     = insn->reg  | (current & 0x38) >> 3;
     unsigned base    = insn->base |  current & 0x07;
 
-    unsigned use_sib = 0;
-    unsigned scale   = 0, index = 0;
+    unsigned use_sib = 0, nobase = 0;
+    unsigned scale   = 0, index  = 0;
 
     if (use_sib = mod != 3 && (current & 0x07) == XV_RSP) {
       INC_AND_CHECK_BOUNDS(ENDS);
@@ -450,25 +470,27 @@ int xv_x64_read_insn(xv_x64_const_ibuffer *const buf,
       scale   =               (current & 0xc0) >> 6;
       index   = insn->index | (current & 0x38) >> 3;
       base    = insn->base & 0x08 | current & 0x07;
+      nobase  = !mod && (base & 0x07) == XV_RBP;
     }
 
     int const displacement_bytes =
-        mod == 0 ? (base & 0x07) == XV_RBP
-                   || use_sib && base == XV_RBP ? 4 : 0
+        mod == 0 ? (base & 0x07) == XV_RBP ? 4 : 0
       : mod == 1 ? 1
       : mod == 2 ? 4
       :            0;
 
-    /* Now parse out the intent through Intel's minefield of special cases. */
+    /* Now parse out the intent through Intel's minefield of special cases.
+     * Note that REX.B doesn't rescue %r13 from meaning "no base" when mod is
+     * zero; only the low three bits are considered. Likewise, %rsp is only an
+     * "absent" index if REX.X is also clear (%r12 is a valid index). */
     insn->addr =
-        use_sib ? !mod && base  == XV_RBP
-                       && index == XV_RSP ? XV_ADDR_ZEROREL
-                : index == XV_RSP         ? XV_ADDR_BASE
-                :                           XV_ADDR_SCALE_BIT | scale
-      :           mod == 3                ? XV_ADDR_REG
-                : !mod && base == XV_RBP  ? insn->p2 ? XV_ADDR_ZEROREL
-                                                     : XV_ADDR_RIPREL
-                                          : XV_ADDR_BASE;
+        use_sib ? index == XV_RSP ? nobase ? XV_ADDR_ZEROREL : XV_ADDR_BASE
+                :                   XV_ADDR_SCALE_BIT | scale
+      :           mod == 3                          ? XV_ADDR_REG
+                : !mod && (base & 0x07) == XV_RBP   ? XV_ADDR_RIPREL
+                :                                     XV_ADDR_BASE;
+
+    insn->nobase = nobase && insn->addr & XV_ADDR_SCALE_BIT;
 
     insn->reg   = reg;          /* always defined */
     insn->base  = base;         /* always defined */
@@ -479,6 +501,8 @@ int xv_x64_read_insn(xv_x64_const_ibuffer *const buf,
     CHECK_BOUNDS(ENDD);
     for (int i = 0; i < displacement_bytes; ++i)
       insn->displacement = insn->displacement << 8 | buf->start[offset - i];
+    if (displacement_bytes == 1)
+      insn->displacement = (int8_t) insn->displacement;
 
     xv_x64_trace(0,
                  "xv_x64_read_insn(%x) parsed modR/M and SIB:\n"
@@ -496,6 +520,12 @@ int xv_x64_read_insn(xv_x64_const_ibuffer *const buf,
   for (int i = 0; i < immediate_size; ++i)
     insn->immediate = insn->immediate << 8 | buf->start[offset - i];
 
+  /* Branch displacements are signed; everything else is kept as raw bits so
+   * that we reproduce it exactly. */
+  if (xv_x64_immrelp(insn) && immediate_size < 8)
+    insn->immediate = insn->immediate << 64 - 8 * immediate_size
+                                      >> 64 - 8 * immediate_size;
+
   xv_x64_trace(0,
                "xv_x64_read_insn(%x) imm(%d) = %llx\n",
                offset, immediate_size, (uint64_t) insn->immediate);
@@ -527,12 +557,19 @@ static xv_x64_const_i xv_g1v[4] = { 0x00, 0xf0, 0xf2, 0xf3 };
 static xv_x64_const_i xv_g2v[7] = { 0x00, 0x2e, 0x36, 0x3e, 0x26, 0x64, 0x65 };
 
 /* Return nonzero if the quantity stored in x overflows the given number of
- * bits; also works for unsigned data */
+ * bits as a signed value */
 static inline int xv_overflowp(int64_t  const x,
                                unsigned const bits) {
-  int64_t const high = x >> bits;
-  int64_t const low  = x & (1 << bits) - 1;
-  return high != 0 && high != -1 || x < 0 != low < 0;
+  if (bits >= 64) return 0;
+  int64_t const high = x >> bits - 1;
+  return high != 0 && high != -1;
+}
+
+/* Same, but also accept unsigned values; invariant immediates are stored as
+ * raw bits, so 0xff is as valid an imm8 as -1 is */
+static inline int xv_uoverflowp(int64_t  const x,
+                                unsigned const bits) {
+  return xv_overflowp(x, bits) && (bits >= 64 || (uint64_t) x >> bits);
 }
 
 int xv_x64_write_insn(xv_x64_ibuffer    *const buf,
@@ -552,52 +589,68 @@ int xv_x64_write_insn(xv_x64_ibuffer    *const buf,
   if (enc == XV_INVALID) WRITE_ERROR(INV);
 
   /* Validity check: are we trying to encode an immediate larger than what the
-   * instruction supports? */
-  if (xv_overflowp(insn->immediate, 8 * xv_x64_immediate_bytes(insn)))
+   * instruction supports? Branch displacements are signed. */
+  int const immediate_bytes = xv_x64_immediate_bytes(insn);
+  if (immediate_bytes && (xv_x64_immrelp(insn)
+                            ? xv_overflowp(insn->immediate, 8 * immediate_bytes)
+                            : xv_uoverflowp(insn->immediate,
+                                            8 * immediate_bytes)))
     WRITE_ERROR(EOP);
 
-  /* Reconstruct group 1, 2, 3, and 4 prefixes */
-  if (insn->p1)  stage[index++] = xv_g1v[insn->p1];
-  if (insn->p2)  stage[index++] = xv_g2v[insn->p2];
-  if (insn->p66) stage[index++] = 0x66;
-  if (insn->p67) stage[index++] = 0x67;
+  /* Reconstruct group 1, 2, 3, and 4 prefixes. VEX encodes the 66, f2 and f3
+   * prefixes itself, so we omit those here. */
+  int const vex = insn->vex || insn->xop;
+  if (insn->p1 && (!vex || insn->p1 == XV_INSN_LOCK))
+                  stage[index++] = xv_g1v[insn->p1];
+  if (insn->p2)   stage[index++] = xv_g2v[insn->p2];
+  if (insn->p66 && !vex)
+                  stage[index++] = 0x66;
+  if (insn->p67)  stage[index++] = 0x67;
+
+  /* REX.X only means something when we have an index register, and REX.B only
+   * when we have a base (or opcode-embedded) register. */
+  int const x_bit = insn->addr & XV_ADDR_SCALE_BIT && insn->index >> 3 & 1;
+  int const b_bit = !insn->nobase && insn->base >> 3 & 1;
 
   /* Encode any REX or VEX prefix */
-  if (insn->vex || insn->xop) {
+  if (vex) {
     /* Preserve VEX */
+    xv_x64_i const pp        = insn->p66                 ? 1
+                             : insn->p1 == XV_INSN_REPZ  ? 2
+                             : insn->p1 == XV_INSN_REPNZ ? 3
+                             :                             0;
     xv_x64_i const vvvv_l_pp = (~insn->aux & 0x0f) << 3
                              | insn->vex_l         << 2
-                             | insn->escape;
+                             | pp;
 
     if (insn->xop
         || insn->escape != XV_INSN_ESC1
         || insn->rex_w
-        || 0x08 & (insn->index | insn->base | insn->reg)) {
+        || x_bit
+        || b_bit) {
       /* Need a three-byte prefix */
       xv_x64_i const xop_compatibility_bit = insn->xop << 3;
 
-      stage[index++] = 0xc4;
-      stage[index++] = (1 & ~insn->reg   >> 3) << 7
-                     | (insn->addr & XV_ADDR_SCALE_BIT &&
-                        1 & ~insn->index >> 3) << 6
-                     | (1 & ~insn->base  >> 3) << 5
+      stage[index++] = insn->xop ? 0x8f : 0xc4;
+      stage[index++] = !(insn->reg >> 3 & 1) << 7
+                     | !x_bit                << 6
+                     | !b_bit                << 5
                      | xop_compatibility_bit
                      | insn->escape;
       stage[index++] = insn->rex_w << 7 | vvvv_l_pp;
     } else {
       /* Two-byte prefix */
       stage[index++] = 0xc5;
-      stage[index++] = (1 & ~insn->reg >> 3) << 7 | vvvv_l_pp;
+      stage[index++] = !(insn->reg >> 3 & 1) << 7 | vvvv_l_pp;
     }
   } else {
-    if (insn->rex_w || 0x08 & (insn->reg | insn->index | insn->base))
+    if (insn->rex || insn->rex_w || insn->reg & 0x08 || x_bit || b_bit)
       /* REX is required */
       stage[index++] = 0x40
-                     | insn->rex_w            << 3
-                     | (1 & insn->reg   >> 3) << 2
-                     | (insn->addr & XV_ADDR_SCALE_BIT &&
-                        1 & insn->index >> 3) << 1
-                     | (1 & insn->base  >> 3) << 0;
+                     | insn->rex_w          << 3
+                     | (insn->reg >> 3 & 1) << 2
+                     | x_bit                << 1
+                     | b_bit                << 0;
 
     /* Opcode escaping: VEX captures this information inside the prefix, but
      * REX and no-prefix forms require us to write escape bytes */
@@ -637,26 +690,34 @@ int xv_x64_write_insn(xv_x64_ibuffer    *const buf,
         :                                       1;
 
       /* In certain cases, x86 machine code won't be able to encode the
-       * displacement as such. So we may need to increase the size if, for
-       * instance, we're RIP-relative or zero-relative. */
-      int const sib_escaped        = (insn->base & 0x07) == XV_RSP;
+       * displacement as such. %rip-relative, zero-relative, and base-less
+       * scaled addresses always take four bytes; and because mod = 0 with a
+       * base of %rbp or %r13 means "no base," those registers need at least a
+       * one-byte displacement. */
+      int const absolute           = insn->addr == XV_ADDR_RIPREL
+                                  || insn->addr == XV_ADDR_ZEROREL
+                                  || insn->nobase;
+      int const rbp_escaped        = (insn->base & 0x07) == XV_RBP;
       int const displacement_bytes =
-          insn->addr == XV_ADDR_RIPREL
-          || insn->addr == XV_ADDR_ZEROREL ? 4
-        : sib_escaped                      ? displacement_min_bytes > 1
-                                           ? displacement_min_bytes : 1
-        :                                  displacement_min_bytes;
-
-      int const sib_required = sib_escaped
+          absolute                                 ? 4
+        : rbp_escaped && !displacement_min_bytes   ? 1
+        :                                            displacement_min_bytes;
+
+      /* Similarly, a base of %rsp or %r12 in the ModR/M byte means "SIB
+       * follows." */
+      int const sib_required = (insn->base & 0x07) == XV_RSP
+                                 && insn->addr == XV_ADDR_BASE
                             || insn->addr & XV_ADDR_SCALE_BIT
                             || insn->addr == XV_ADDR_ZEROREL;
 
-      xv_x64_i const mod = insn->addr == XV_ADDR_ZEROREL ? 0
-                         : displacement_bytes == 0       ? 0
-                         : displacement_bytes == 1       ? 0x40
-                         :                                 0x80;
+      xv_x64_i const mod = absolute                ? 0
+                         : displacement_bytes == 0 ? 0
+                         : displacement_bytes == 1 ? 0x40
+                         :                           0x80;
 
-      if (sib_required) {
+      if (insn->addr == XV_ADDR_RIPREL)
+        stage[index++] = insn->reg << 3 & 0x38 | XV_RBP;
+      else if (sib_required) {
         /* ModR/M needs to encode SIB, the register, and the appropriate number
          * of displacement bits. */
         stage[index++] = mod | insn->reg << 3 & 0x38 | XV_RSP;
@@ -667,7 +728,7 @@ int xv_x64_write_insn(xv_x64_ibuffer    *const buf,
           : insn->addr == XV_ADDR_BASE    ? XV_RSP << 3 | insn->base & 0x07
           : /* normal SIB */ (insn->addr & XV_ADDR_SCALE_MASK) << 6
                              | insn->index << 3 & 0x38
-                             | insn->base       & 0x07;
+                             | (insn->nobase ? XV_RBP : insn->base & 0x07);
       } else {
         /* Encode ModR/M byte normally, considering the amount of displacement
          * to use. */
@@ -677,7 +738,7 @@ int xv_x64_write_insn(xv_x64_ibuffer    *const buf,
 
       xv_x64_trace(0,
                    "xv_x64_write_insn(%x) dispsize = %d, sib = %d, mod = %x\n",
-                   buf ? buf->current - buf->start : 0,
+                   buf ? (unsigned) (buf->current - buf->start) : 0,
                    displacement_bytes, sib_required, mod);
 
       for (int i = 0; i < displacement_bytes; ++i)
@@ -685,13 +746,15 @@ int xv_x64_write_insn(xv_x64_ibuffer    *const buf,
     }
   }
 
-  int const immediate_bytes = xv_x64_immediate_bytes(insn);
   if (!immediate_bytes && insn->immediate) WRITE_ERROR(EIMM);
   for (int i = 0; i < immediate_bytes; ++i)
     stage[index++] = insn->immediate >> i * 8 & 0xff;
 
-  if (buf) {
-    if (buf->current + index >= buf->start + buf->capacity) WRITE_ERROR(END);
+  if (buf && xv_x64_sizingp(buf)) {
+    buf->current += index;
+    return XV_WR_CONT;
+  } else if (buf) {
+    if (buf->current + index > buf->start + buf->capacity) WRITE_ERROR(END);
     memcpy(buf->current, stage, index);
     buf->current += index;
     return XV_WR_CONT;
@@ -861,9 +924,2455 @@ inline int xv_x64_syscallp(xv_x64_insn const *const insn) {
            && insn->immediate == 0x80;
 }
 
-int xv_x64_step_rw(xv_x64_rewriter *const shared_rw) {
-  /* TODO */
-  return XV_RW_W;
+inline int xv_x64_branchp(xv_x64_insn const *const insn) {
+  if (insn->vex || insn->xop) return XV_BRANCH_NONE;
+  if (insn->escape == XV_INSN_ESC1)
+    return (insn->opcode & 0xf0) == 0x80 ? XV_BRANCH_JCC : XV_BRANCH_NONE;
+  if (insn->escape != XV_INSN_ESC0) return XV_BRANCH_NONE;
+
+  switch (insn->opcode) {
+    case 0x70 ... 0x7f: return XV_BRANCH_JCC;
+    case 0xe0 ... 0xe3: return XV_BRANCH_LOOP;
+    case 0xe8:          return XV_BRANCH_CALL;
+    case 0xe9:
+    case 0xeb:          return XV_BRANCH_JMP;
+    case 0xc2:
+    case 0xc3:          return XV_BRANCH_RET;
+    case 0xca:                                  /* retf */
+    case 0xcb:
+    case 0xcf:          return XV_BRANCH_OTHER; /* iret */
+    case 0xff:
+      switch (insn->reg & 0x07) {
+        case 2:         return XV_BRANCH_ICALL;
+        case 4:         return XV_BRANCH_IJMP;
+        case 3:                                 /* far call, far jmp */
+        case 5:         return XV_BRANCH_OTHER;
+      }
+  }
+  return XV_BRANCH_NONE;
+}
+
+/* Bulk scanning. */
+/* xv_x64_read_insn builds a complete xv_x64_insn, which is a lot more than we */
+/* need just to find where instructions start. The scanner works from two */
+/* tables instead: one that classifies prefix bytes, and one per opcode key that */
+/* gives the ModR/M bit, the immediate size class, and whether the opcode can */
+/* branch or make a system call. xv_x64_scan_init derives the second from */
+/* xv_x64_insn_encodings and the predicates above, rather than restating them. */
+/* Threads read the table without synchronizing, so it has to be built before */
+/* there are any; xv_x64_tcache_init does it, and a group's first cache always */
+/* comes before its threads. */
+
+/* An x86 instruction is at most 15 bytes long, so as long as that much input is */
+/* left, xv_x64_scan_insn doesn't bounds-check byte by byte. Anything it isn't */
+/* sure about (the tail of the buffer, an invalid opcode, or an instruction that */
+/* would be too long) gets 0 back, and the caller asks xv_x64_read_insn. That way */
+/* the two can never disagree about lengths. The work is inherently serial, */
+/* since each instruction's start depends on the previous one's length, and */
+/* prefix runs are almost never more than a couple of bytes; so there's nothing */
+/* wide enough here for SIMD to help with. */
+
+#define XV_BYTE_OPCODE 0        /* xv_x64_byte_classes */
+#define XV_BYTE_LEGACY 1
+#define XV_BYTE_REX    2
+#define XV_BYTE_VEX2   3
+#define XV_BYTE_VEX3   4
+#define XV_BYTE_XOP    5        /* 0x8f: XOP or pop, depending on next byte */
+
+static uint8_t const xv_x64_byte_classes[256] = {
+  [0x26] = XV_BYTE_LEGACY, [0x2e] = XV_BYTE_LEGACY,
+  [0x36] = XV_BYTE_LEGACY, [0x3e] = XV_BYTE_LEGACY,
+  [0x64] = XV_BYTE_LEGACY, [0x65] = XV_BYTE_LEGACY,
+  [0x66] = XV_BYTE_LEGACY, [0x67] = XV_BYTE_LEGACY,
+  [0xf0] = XV_BYTE_LEGACY, [0xf2] = XV_BYTE_LEGACY, [0xf3] = XV_BYTE_LEGACY,
+  [0x40 ... 0x4f] = XV_BYTE_REX,
+  [0x8f] = XV_BYTE_XOP,
+  [0xc4] = XV_BYTE_VEX3,
+  [0xc5] = XV_BYTE_VEX2,
+};
+
+/* xv_x64_scan_keys entries: the high byte holds XV_SCAN_* flags that follow
+ * from the opcode alone. */
+#define XV_SCAN_K_IMM     0x0f  /* immediate bytes, or one of these: */
+#define XV_SCAN_K_IMMW    0x09  /*   2 with 0x66, 4 otherwise */
+#define XV_SCAN_K_IMMQ    0x0a  /*   2 with 0x66, 8 with REX.W, 4 otherwise */
+#define XV_SCAN_K_IMMA    0x0b  /*   4 with 0x67, 8 otherwise */
+#define XV_SCAN_K_MODRM   0x10
+#define XV_SCAN_K_GROUP   0x20  /* ModR/M reg changes the immediate or branch */
+#define XV_SCAN_K_INVALID 0x40
+
+static uint16_t xv_x64_scan_keys[1024];
+static int      xv_x64_scan_keys_ready;
+
+static unsigned xv_x64_scan_flags(xv_x64_insn const *const insn) {
+  xv_x64_insn_encoding const enc = xv_x64_insn_encodings[xv_x64_insn_key(insn)];
+  return (xv_x64_branchp(insn) || xv_x64_immrelp(insn) ? XV_SCAN_BRANCH : 0)
+       | (enc & XV_MODRM_MASK && insn->addr == XV_ADDR_RIPREL
+                                               ? XV_SCAN_RIPREL  : 0)
+       | (xv_x64_syscallp(insn)                ? XV_SCAN_SYSCALL : 0);
+}
+
+void xv_x64_scan_init(void) {
+  if (xv_x64_scan_keys_ready) return;
+  for (unsigned key = 0; key < 1024; ++key) {
+    xv_x64_insn insn = { .escape = key >> 8, .opcode = key & 0xff,
+                         .addr   = XV_ADDR_REG, .immediate = 0x80 };
+    if (xv_x64_insn_encodings[key] == XV_INVALID) {
+      xv_x64_scan_keys[key] = XV_SCAN_K_INVALID;
+      continue;
+    }
+
+    unsigned const flags = xv_x64_scan_flags(&insn);
+    unsigned const bytes = xv_x64_immediate_bytes(&insn);
+    unsigned       k     = 0;
+
+    for (insn.reg = 1; insn.reg < 8; ++insn.reg)
+      if (xv_x64_scan_flags(&insn) != flags
+          || xv_x64_immediate_bytes(&insn) != bytes)
+        k |= XV_SCAN_K_GROUP;
+    insn.reg = 0;
+
+    insn.p66   = 1; unsigned const w = xv_x64_immediate_bytes(&insn);
+    insn.p66   = 0;
+    insn.rex_w = 1; unsigned const q = xv_x64_immediate_bytes(&insn);
+    insn.rex_w = 0;
+    insn.p67   = 1; unsigned const a = xv_x64_immediate_bytes(&insn);
+
+    k |= q != bytes ? XV_SCAN_K_IMMQ
+       : w != bytes ? XV_SCAN_K_IMMW
+       : a != bytes ? XV_SCAN_K_IMMA
+       :              bytes;
+
+    if (xv_x64_insn_encodings[key] & XV_MODRM_MASK) k |= XV_SCAN_K_MODRM;
+    xv_x64_scan_keys[key] = k | flags << 8;
+  }
+  xv_x64_scan_keys_ready = 1;
+}
+
+/* Returns the length of the instruction at code and sets *flags, or returns 0
+ * if xv_x64_read_insn needs to look at it. At least 15 bytes at code must be
+ * readable. */
+static unsigned xv_x64_scan_insn(xv_x64_const_i *const code,
+                                 unsigned       *const flags) {
+  xv_x64_const_i *const limit = code + 15;
+  xv_x64_const_i       *p     = code;
+  unsigned p66 = 0, p67 = 0, rex_w = 0, vex = 0;
+  unsigned escape = XV_INSN_ESC0;
+  unsigned c;
+
+  /* Leave %gs prefixes to xv_x64_read_insn, so that translation sees them. */
+  while ((c = xv_x64_byte_classes[*p]) == XV_BYTE_LEGACY) {
+    if (*p == 0x65) return 0;
+    p66 |= *p == 0x66;
+    p67 |= *p == 0x67;
+    if (++p >= limit) return 0;
+  }
+
+  for (; c == XV_BYTE_REX; c = xv_x64_byte_classes[*p]) {
+    rex_w |= *p & 0x08;
+    if (++p >= limit) return 0;
+  }
+
+  if (c == XV_BYTE_VEX2) {
+    if (p + 2 >= limit) return 0;
+    escape = XV_INSN_ESC1;
+    p66   |= (p[1] & 0x03) == 1;
+    p     += 2;
+    vex    = 1;
+  } else if (c == XV_BYTE_VEX3
+             || c == XV_BYTE_XOP && p + 1 < limit && p[1] & 0x08) {
+    if (p + 3 >= limit) return 0;
+    escape = p[1] & 0x03;             /* as xv_x64_insn.escape keeps it */
+    rex_w  = p[2] & 0x80;
+    p66   |= (p[2] & 0x03) == 1;
+    p     += 3;
+    vex    = 1;
+  } else if (*p == 0x0f) {
+    if (++p >= limit) return 0;
+    escape = *p == 0x38 ? XV_INSN_ESC238
+           : *p == 0x3a ? XV_INSN_ESC23A
+           :              XV_INSN_ESC1;
+    if (escape != XV_INSN_ESC1 && ++p >= limit) return 0;
+  }
+
+  unsigned const opcode = *p;
+  unsigned const k      = xv_x64_scan_keys[escape << 8 | opcode];
+  unsigned       reg    = 0;
+  if (k & XV_SCAN_K_INVALID) return 0;
+
+  *flags = k >> 8;
+
+  if (k & XV_SCAN_K_MODRM) {
+    if (++p >= limit) return 0;
+    unsigned const mod  = *p >> 6;
+    unsigned const rm   = *p & 0x07;
+    unsigned       base = rm;
+    reg = *p >> 3 & 0x07;
+
+    if (mod != 3 && rm == XV_RSP) {
+      if (++p >= limit) return 0;
+      base = *p & 0x07;
+    }
+
+    if (!mod && rm == XV_RBP) *flags |= XV_SCAN_RIPREL;
+    p += mod == 1                              ? 1
+       : mod == 2 || !mod && base == XV_RBP    ? 4
+       :                                         0;
+  }
+
+  unsigned imm = k & XV_SCAN_K_IMM;
+  if (k & XV_SCAN_K_GROUP) {
+    xv_x64_insn const insn = { .escape = escape, .opcode = opcode,
+                               .reg    = reg,    .vex    = vex,
+                               .p66    = p66,    .p67    = p67,
+                               .rex_w  = !!rex_w };
+    imm     = xv_x64_immediate_bytes(&insn);
+    *flags |= xv_x64_branchp(&insn) ? XV_SCAN_BRANCH : 0;
+  } else if (imm == XV_SCAN_K_IMMW)
+    imm = p66 ? 2 : 4;
+  else if (imm == XV_SCAN_K_IMMQ)
+    imm = p66 ? 2 : rex_w ? 8 : 4;
+  else if (imm == XV_SCAN_K_IMMA)
+    imm = p67 ? 4 : 8;
+
+  unsigned const length = p + 1 - code + imm;
+  return length <= 15 ? length : 0;
+}
+
+unsigned xv_x64_scan(xv_x64_const_ibuffer *const buf,
+                     xv_x64_scan_entry    *const entries,
+                     unsigned              const n) {
+  xv_x64_const_i *const end = buf->start + buf->capacity;
+  unsigned              i   = 0;
+
+  for (; i < n && buf->current < end; ++i) {
+    unsigned flags  = 0;
+    unsigned length = end - buf->current >= 15
+                    ? xv_x64_scan_insn(buf->current, &flags)
+                    : 0;
+
+    if (!length) {
+      xv_x64_const_ibuffer next = *buf;
+      xv_x64_insn          insn;
+      if (xv_x64_read_insn(&next, &insn)) break;
+      length = next.current - buf->current;
+      flags  = xv_x64_scan_flags(&insn);
+    }
+
+    entries[i].offset = buf->current - buf->start;
+    entries[i].length = length;
+    entries[i].flags  = flags;
+    buf->current     += length;
+  }
+
+  return i;
+}
+
+/* Relocation. */
+/* An instruction whose meaning depends on its own address needs to be adjusted */
+/* when we move it. There are exactly two such cases: %rip-relative memory */
+/* operands and relative branches. For both, we compute the absolute address */
+/* that the original instruction referred to, then re-express it relative to */
+/* the instruction's new location. Neither size depends on the displacement */
+/* value (%rip-relative is always disp32 and branch immediates are sized by */
+/* opcode), so we can size the instruction first and then fill in the offset. */
+
+/* Short branches usually can't reach the original code from the translation */
+/* cache, so we promote them to rel32 forms. loop and j[er]cxz don't have one, so */
+/* they fail here with XV_WR_EOP; the block translator handles them separately. */
+
+static int xv_x64_relocate_insn(xv_x64_ibuffer *const dst,
+                                xv_x64_insn    *const insn) {
+  xv_x64_insn_encoding const enc = xv_x64_insn_encodings[xv_x64_insn_key(insn)];
+  int const riprel = enc & XV_MODRM_MASK && insn->addr == XV_ADDR_RIPREL;
+  int const relimm = xv_x64_immrelp(insn);
+
+  if (!riprel && !relimm) return xv_x64_write_insn(dst, insn);
+
+  if (relimm && insn->escape == XV_INSN_ESC0) {
+    if ((insn->opcode & 0xf0) == 0x70)
+      insn->escape = XV_INSN_ESC1, insn->opcode += 0x10;
+    else if (insn->opcode == 0xeb)
+      insn->opcode = 0xe9;
+  }
+
+  intptr_t const new_rip = (intptr_t) dst->current
+                         + xv_x64_write_insn(NULL, insn);
+
+  if (riprel) {
+    int64_t const d = (intptr_t) insn->rip + insn->displacement - new_rip;
+    if (xv_overflowp(d, 32)) return XV_WR_EDISP;
+    insn->displacement = d;
+  }
+
+  if (relimm)
+    insn->immediate = (intptr_t) insn->rip + insn->immediate - new_rip;
+
+  return xv_x64_write_insn(dst, insn);
+}
+
+int xv_x64_step_rw(xv_x64_rewriter *const rw) {
+  xv_x64_const_ibuffer src = rw->src;
+  xv_x64_insn          insn;
+  int                  status;
+
+  if (status = xv_x64_read_insn(&src, &insn))        return XV_RW_R | status;
+  if (status = xv_x64_relocate_insn(&rw->dst, &insn)) return XV_RW_W | status;
+
+  rw->src = src;
+  return XV_RW_CONT;
+}
+
+/* Exit receiver. */
+/* See "Translation cache" in xv-x64.h for the stub protocol. By the time we get */
+/* here, the stub has reserved XV_X64_EXIT_STACK bytes and pushed the address of */
+/* its own data, so the frame we build lines up with xv_x64_exit_frame. We also */
+/* save the SSE state, since the C code is free to clobber it, and clear the */
+/* direction flag as the ABI requires. */
+
+asm (".text\n"
+     ".globl xv_x64_exit_receiver\n"
+     "xv_x64_exit_receiver:\n"
+     "  pushfq\n"
+     "  push %rax\n"
+     "  push %rcx\n"
+     "  push %rdx\n"
+     "  push %rbx\n"
+     "  push %rbp\n"
+     "  push %rsi\n"
+     "  push %rdi\n"
+     "  push %r8\n"
+     "  push %r9\n"
+     "  push %r10\n"
+     "  push %r11\n"
+     "  push %r12\n"
+     "  push %r13\n"
+     "  push %r14\n"
+     "  push %r15\n"
+     "  mov %rsp, %rdi\n"
+     "  mov %rsp, %rbx\n"
+     "  and $-16, %rsp\n"
+     "  sub $512, %rsp\n"
+     "  fxsave64 (%rsp)\n"
+     "  cld\n"
+     "  call xv_x64_tcache_dispatch\n"
+     "  fxrstor64 (%rsp)\n"
+     "  mov %rbx, %rsp\n"
+     "  mov %rax, 128(%rsp)\n"                  /* frame->resume */
+     "  pop %r15\n"
+     "  pop %r14\n"
+     "  pop %r13\n"
+     "  pop %r12\n"
+     "  pop %r11\n"
+     "  pop %r10\n"
+     "  pop %r9\n"
+     "  pop %r8\n"
+     "  pop %rdi\n"
+     "  pop %rsi\n"
+     "  pop %rbp\n"
+     "  pop %rbx\n"
+     "  pop %rdx\n"
+     "  pop %rcx\n"
+     "  pop %rax\n"
+     "  popfq\n"
+     "  ret $136\n");
+
+xv_static_assert(XV_X64_EXIT_STACK == 136)
+
+asm (".text\n"
+     ".globl xv_x64_untranslatable\n"
+     "xv_x64_untranslatable:\n"
+     "  ud2\n");
+
+/* Translation cache memory. */
+/* Translated code makes %rip-relative references to the original code's data, */
+/* so it needs to be within 2GB of the whole region (see doc/mmap.md). We ask the */
+/* kernel for space just below the region, then just above it. The address is */
+/* only a hint, so we check what we got; if it's out of range, something else */
+/* (often another thread's cache) is in the way, and we try again further out. */
+
+/* The same mapping starts with the xv_x64_tcache_shared page(s) and the block */
+/* counters, so that translated code can reach those %rip-relative too. */
+
+#define XV_X64_NEAR_GAP (16 << 20)
+#define XV_X64_NEAR_MAX ((int64_t) 1 << 31)
+
+static inline int xv_x64_mmap_failedp(void const *const p) {
+  return p <= (void*) -1 && p > (void*) -4096;
+}
+
+static void *xv_x64_mmap(void const *const hint,
+                         ssize_t     const size,
+                         int         const prot) {
+  return (void*) xv_syscall6(__NR_mmap, (xv_register) hint, size, prot,
+                             MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+}
+
+static void *xv_x64_mmap_near(xv_x64_const_i *const start,
+                              ssize_t         const size,
+                              ssize_t         const cache_size) {
+  intptr_t const lo = (intptr_t) start;
+  intptr_t const hi = lo + size;
+
+  for (intptr_t out = XV_X64_NEAR_GAP; out < XV_X64_NEAR_MAX;
+       out += cache_size + XV_X64_NEAR_GAP)
+    for (int i = 0; i < 2; ++i) {
+      intptr_t const hint = i ? hi + out + PAGESIZE - 1 & ~(PAGESIZE - 1)
+                              : lo - cache_size - out & ~(PAGESIZE - 1);
+      if (hint <= 0) continue;
+
+      void *const region = xv_x64_mmap((void const*) hint, cache_size,
+                                       PROT_READ | PROT_WRITE | PROT_EXEC);
+      if (xv_x64_mmap_failedp(region)) return region;
+
+      intptr_t const r = (intptr_t) region;
+      if (r + cache_size - lo < XV_X64_NEAR_MAX && hi - r < XV_X64_NEAR_MAX)
+        return region;
+      xv_syscall2(__NR_munmap, r, cache_size);
+    }
+
+  return (void*) -ENOMEM;
+}
+
+static inline ssize_t xv_x64_tcache_map_size(xv_x64_tcache const *const tc) {
+  return sizeof(xv_x64_tcache_map)
+       + (sizeof(xv_x64_tcache_entry) << tc->table_bits);
+}
+
+/* The block array, its index, and the relocations share a mapping. */
+static inline ssize_t xv_x64_tcache_blocks_size(
+    xv_x64_tcache const *const tc) {
+  return tc->block_capacity * sizeof(xv_x64_block)
+       + (sizeof(uint32_t) << tc->index_bits)
+       + tc->reloc_capacity * sizeof(xv_x64_reloc);
+}
+
+#define XV_X64_SHARED_SIZE \
+  (sizeof(xv_x64_tcache_shared) + PAGESIZE - 1 & ~(PAGESIZE - 1))
+
+#define XV_X64_COUNTERS_SIZE(blocks) \
+  ((blocks) * sizeof(uint32_t) + PAGESIZE - 1 & ~(PAGESIZE - 1))
+
+static unsigned const xv_x64_intercepted_syscalls[] = {
+  __NR_mmap, __NR_mprotect, __NR_munmap, __NR_mremap,
+  __NR_rt_sigaction, __NR_clone, __NR_exit,
+#ifdef __NR_clone3
+  __NR_clone3,
+#endif
+};
+
+/* Set up tc on its own, or as a member of parent's group. A cache for a clone
+ * joins even if the table wasn't sized for it (see xv_x64_tcache_relink). */
+static int xv_x64_tcache_setup(xv_x64_tcache  *const tc,
+                               xv_x64_tcache  *const parent,
+                               xv_x64_const_i *const code,
+                               ssize_t         const size,
+                               ssize_t         const cache_size,
+                               unsigned        const max_blocks,
+                               unsigned        const max_caches,
+                               int             const spawned) {
+  ssize_t const rounded = cache_size + PAGESIZE - 1 & ~(PAGESIZE - 1);
+  ssize_t const below   = XV_X64_SHARED_SIZE
+                        + XV_X64_COUNTERS_SIZE(max_blocks);
+  unsigned      reserved = 0;
+
+  memset(tc, 0, sizeof(xv_x64_tcache));
+  tc->rw.src.logical_start = tc->rw.src.start = tc->rw.src.current = code;
+  tc->rw.src.capacity      = size;
+  tc->block_capacity       = max_blocks;
+  tc->reloc_capacity       = rounded / 8;
+  tc->next                 = tc;
+  tc->spawned              = spawned;
+
+  /* Keep the tables at most half full so probe sequences stay short. */
+  for (tc->index_bits = 4; 1u << tc->index_bits < 2 * max_blocks;
+       ++tc->index_bits);
+  if (parent)
+    tc->table_bits = parent->table_bits;
+  else
+    for (tc->table_bits = tc->index_bits;
+         1ul << tc->table_bits < 2ul * max_blocks * max_caches;
+         ++tc->table_bits);
+
+  void *const dst    = xv_x64_mmap_near(code, size, below + rounded);
+  void *const blocks = xv_x64_mmap(NULL, xv_x64_tcache_blocks_size(tc),
+                                   PROT_READ | PROT_WRITE);
+  void *const map    = parent ? parent->map
+                              : xv_x64_mmap(NULL, xv_x64_tcache_map_size(tc),
+                                            PROT_READ | PROT_WRITE);
+
+  if (!xv_x64_mmap_failedp(dst)) {
+    tc->shared               = dst;
+    tc->counters             = (uint32_t*) ((xv_x64_i*) dst
+                                            + XV_X64_SHARED_SIZE);
+    tc->rw.dst.logical_start = tc->rw.dst.start = tc->rw.dst.current
+                             = (xv_x64_i*) dst + below;
+    tc->rw.dst.capacity      = rounded;
+  }
+  if (!xv_x64_mmap_failedp(blocks)) {
+    tc->blocks = blocks;
+    tc->index  = (uint32_t*) (tc->blocks + max_blocks);
+    tc->relocs = (xv_x64_reloc*) (tc->index + (1u << tc->index_bits));
+  }
+  if (!xv_x64_mmap_failedp(map)) {
+    tc->map   = map;
+    tc->table = tc->map->entries;
+    __atomic_add_fetch(&tc->map->caches, 1, __ATOMIC_RELAXED);
+    reserved = __atomic_add_fetch(&tc->map->reserved, max_blocks,
+                                  __ATOMIC_RELAXED);
+  }
+  if (tc->shared) {
+    tc->shared->table       = tc->table;
+    tc->shared->thread.self = &tc->shared->thread;
+    tc->shared->thread.tc   = tc;
+  }
+
+  if (!tc->rw.dst.start || !tc->blocks || !tc->table) {
+    xv_x64_tcache_free(tc);
+    return xv_x64_mmap_failedp(dst)    ? (int) (intptr_t) dst
+         : xv_x64_mmap_failedp(blocks) ? (int) (intptr_t) blocks
+         :                               (int) (intptr_t) map;
+  }
+  if (reserved > 1u << tc->table_bits - 1 && !spawned) {
+    xv_x64_tcache_free(tc);
+    return -ENOSPC;
+  }
+
+  if (parent) {
+    memcpy(tc->shared->syscall_policy, parent->shared->syscall_policy,
+           sizeof(tc->shared->syscall_policy));
+    tc->syscall_handler = parent->syscall_handler;
+    tc->trace_threshold   = parent->trace_threshold;
+    tc->native_escape     = parent->native_escape;
+    tc->thread_cache_size = parent->thread_cache_size;
+    tc->thread_blocks     = parent->thread_blocks;
+
+    /* Threads can make caches for their clones while others run. */
+    xv_x64_tcache *next = __atomic_load_n(&parent->next, __ATOMIC_ACQUIRE);
+    do tc->next = next;
+    while (!__atomic_compare_exchange_n(&parent->next, &next, tc, 1,
+                                        __ATOMIC_RELEASE, __ATOMIC_ACQUIRE));
+  }
+
+  return 0;
+}
+
+int xv_x64_tcache_init(xv_x64_tcache  *const tc,
+                       xv_x64_const_i *const code,
+                       ssize_t         const size,
+                       ssize_t         const cache_size,
+                       unsigned        const max_blocks,
+                       unsigned        const max_caches) {
+  int status;
+
+  xv_x64_scan_init();
+  if (status = xv_x64_tcache_setup(tc, NULL, code, size, cache_size,
+                                   max_blocks, max_caches, 0))
+    return status;
+  tc->thread_cache_size = cache_size;
+  tc->thread_blocks     = max_blocks;
+
+  for (unsigned i = 0; i < sizeof(xv_x64_intercepted_syscalls)
+                           / sizeof(*xv_x64_intercepted_syscalls); ++i)
+    xv_x64_tcache_intercept(tc, xv_x64_intercepted_syscalls[i], 1);
+
+  return 0;
+}
+
+int xv_x64_tcache_init_thread(xv_x64_tcache *const tc,
+                              xv_x64_tcache *const parent,
+                              ssize_t        const cache_size,
+                              unsigned       const max_blocks) {
+  return xv_x64_tcache_setup(tc, parent, parent->rw.src.start,
+                             parent->rw.src.capacity, cache_size, max_blocks,
+                             0, 0);
+}
+
+static void xv_x64_tcache_relink(xv_x64_tcache *tc);
+
+/* Leaving a group means taking our translations out of the others' table and
+ * links first. */
+int xv_x64_tcache_free(xv_x64_tcache *const tc) {
+  int status = 0;
+
+  if (tc->next && tc->next != tc) {
+    xv_x64_tcache *p = tc->next;
+    while (p->next != tc) p = p->next;
+    p->next  = tc->next;
+    tc->next = tc;
+    xv_x64_tcache_relink(p);
+  }
+
+  if (tc->shared)
+    status = status ?: xv_syscall2(__NR_munmap, (xv_register) tc->shared,
+                                   XV_X64_SHARED_SIZE
+                                   + XV_X64_COUNTERS_SIZE(tc->block_capacity)
+                                   + tc->rw.dst.capacity);
+  if (tc->blocks)
+    status = status ?: xv_syscall2(__NR_munmap, (xv_register) tc->blocks,
+                                   xv_x64_tcache_blocks_size(tc));
+  if (tc->map)
+    __atomic_sub_fetch(&tc->map->reserved, tc->block_capacity,
+                       __ATOMIC_RELAXED);
+  if (tc->map && !__atomic_sub_fetch(&tc->map->caches, 1, __ATOMIC_RELAXED))
+    status = status ?: xv_syscall2(__NR_munmap, (xv_register) tc->map,
+                                   xv_x64_tcache_map_size(tc));
+
+  tc->rw.dst.start = tc->rw.dst.current = NULL;
+  tc->shared       = NULL;
+  tc->counters     = NULL;
+  tc->blocks       = NULL;
+  tc->index        = NULL;
+  tc->relocs       = NULL;
+  tc->map          = NULL;
+  tc->table        = NULL;
+  return status;
+}
+
+static void xv_x64_tcache_clear(xv_x64_tcache *const tc) {
+  unsigned const n = 1u << tc->table_bits;
+  for (unsigned i = 0; i < n; ++i)
+    tc->table[i].orig = tc->table[i].code = NULL;
+  tc->map->count = 0;
+
+  xv_x64_tcache *c = tc;
+  do {
+    for (unsigned i = 0; i < XV_X64_SHADOW_DEPTH; ++i)
+      c->shared->thread.shadow[i].orig = NULL;
+  } while ((c = c->next) != tc);
+}
+
+/* tc->index finds a cache's own latest block for an original address, which
+ * the shared table can't do: its entry might be another cache's. Only the
+ * thread that owns the cache uses it, so it doesn't need to be atomic. */
+#define xv_x64_index_hash(tc, addr) \
+  ((uint32_t) (uintptr_t) (addr) * 0x9e3779b1u >> 32 - (tc)->index_bits)
+
+static void xv_x64_index_clear(xv_x64_tcache *const tc) {
+  memset(tc->index, 0, sizeof(uint32_t) << tc->index_bits);
+}
+
+static void xv_x64_index_insert(xv_x64_tcache *const tc,
+                                unsigned       const i) {
+  unsigned    const mask  = (1u << tc->index_bits) - 1;
+  void const *const start = tc->blocks[i].start;
+  for (unsigned h = xv_x64_index_hash(tc, start);; h = h + 1 & mask)
+    if (!tc->index[h] || tc->blocks[tc->index[h] - 1].start == start) {
+      tc->index[h] = i + 1;
+      return;
+    }
+}
+
+static xv_x64_block *xv_x64_index_find(xv_x64_tcache *const tc,
+                                       void const    *const orig) {
+  unsigned const mask = (1u << tc->index_bits) - 1;
+  for (unsigned h = xv_x64_index_hash(tc, orig); tc->index[h];
+       h = h + 1 & mask)
+    if (tc->blocks[tc->index[h] - 1].start == orig)
+      return &tc->blocks[tc->index[h] - 1];
+  return NULL;
+}
+
+void xv_x64_tcache_flush(xv_x64_tcache *const tc) {
+  xv_x64_tcache *c = tc;
+  xv_x64_tcache_clear(tc);
+  do {
+    c->rw.dst.current = c->rw.dst.start;
+    c->nblocks        = 0;
+    c->nrelocs        = 0;
+    xv_x64_index_clear(c);
+    ++c->flushes;
+  } while ((c = c->next) != tc);
+}
+
+/* Out-of-range numbers alias, just as they do in translated code; the
+ * handler always sees the real one. */
+void xv_x64_tcache_intercept(xv_x64_tcache *const tc,
+                             unsigned       const nr,
+                             int            const intercept) {
+  tc->shared->syscall_policy[nr & XV_X64_SYSCALLS - 1] = !!intercept;
+}
+
+/* Other threads can be inserting at the same time. A slot's orig never
+ * changes once it's set, and code is written along with it, so the only thing
+ * we have to be careful about is reading orig before code. */
+xv_x64_i *xv_x64_tcache_lookup(xv_x64_tcache const *const tc,
+                               void const          *const orig) {
+  unsigned const mask = (1u << tc->table_bits) - 1;
+  for (unsigned i = xv_x64_tcache_hash(tc, orig);; i = i + 1 & mask) {
+    void const *const o = __atomic_load_n(&tc->table[i].orig,
+                                          __ATOMIC_ACQUIRE);
+    if (o == orig) return __atomic_load_n(&tc->table[i].code,
+                                          __ATOMIC_RELAXED);
+    if (!o)        return NULL;
+  }
+}
+
+/* Claim an empty slot for orig and code in one step; returns nonzero if we
+ * got it. */
+static inline int xv_x64_tcache_publish(xv_x64_tcache_entry *const slot,
+                                        void const          *const orig,
+                                        xv_x64_i            *const code) {
+  void const *o = NULL;
+  xv_x64_i   *c = NULL;
+  uint8_t     ok;
+  asm volatile ("lock cmpxchg16b %1; sete %0"
+                : "=q"(ok), "+m"(*slot), "+a"(o), "+d"(c)
+                : "b"(orig), "c"(code)
+                : "memory", "cc");
+  return ok;
+}
+
+/* If orig is already there, we replace its code; both versions work, so it
+ * doesn't matter which one a racing reader sees. */
+static void xv_x64_tcache_insert(xv_x64_tcache *const tc,
+                                 void const    *const orig,
+                                 xv_x64_i      *const code) {
+  unsigned const mask = (1u << tc->table_bits) - 1;
+  for (unsigned i = xv_x64_tcache_hash(tc, orig);;) {
+    xv_x64_tcache_entry *const slot = &tc->table[i];
+    void const          *const o    = __atomic_load_n(&slot->orig,
+                                                      __ATOMIC_ACQUIRE);
+    if (o == orig) {
+      __atomic_store_n(&slot->code, code, __ATOMIC_RELEASE);
+      return;
+    }
+    if (!o && xv_x64_tcache_publish(slot, orig, code)) {
+      __atomic_add_fetch(&tc->map->count, 1, __ATOMIC_RELAXED);
+      return;
+    }
+    if (o) i = i + 1 & mask;
+  }
+}
+
+/* Sites are 4-byte aligned (see xv_x64_emit_direct_exit), so this is atomic
+ * even while another thread is running the jump. */
+void xv_x64_link(xv_x64_exit *const exit,
+                 xv_x64_i    *const code) {
+  __atomic_store_n(exit->site, code - (xv_x64_i*) (exit->site + 1),
+                   __ATOMIC_RELEASE);
+}
+
+/* Basic-block translation. */
+/* A block is everything up to and including the first control transfer. We */
+/* relocate straight-line instructions with xv_x64_relocate_insn, then replace */
+/* the control transfer with code that exits through the cache: */
+
+/* | jmp rel      -> jmp exit0 */
+/*   jcc rel      -> jcc exit0; jmp exit1 */
+/*   loop rel8    -> loop +2; jmp +n; jmp exit0; jmp exit1 */
+/*   call rel     -> push $orig_return; (shadow push); jmp exit0; jmp exit1 */
+/*   ret [n]      -> lea 8+n-128(%rsp), %rsp; push 120-n(%rsp); (shadow pop; lookup) */
+/*   jmp *r/m     -> lea -128(%rsp), %rsp; push r/m; (lookup) */
+/*   call *r/m    -> push $orig_return; lea -128(%rsp), %rsp; push r/m; */
+/*                   (shadow push; lookup); jmp exit1 */
+/*   syscall      -> (policy check); syscall; jmp exit1 */
+
+/* Return addresses are always original addresses, so that the program never */
+/* sees translated code addresses. If a block ends for any other reason (too */
+/* many instructions, an instruction we can't decode or relocate, or the end of */
+/* the region), it gets a fall-through exit to the next original address. */
+/* `syscall` also ends a block, which leaves room for the handler's exit record. */
+
+/* Direct exits start out pointing at a stub that calls the receiver; linking */
+/* replaces the rel32 with the target block's address. There may be nops before a */
+/* direct exit so that its rel32 is aligned (see "Threads" in xv-x64.h). For */
+/* calls, exit1 is the landing pad that the shadow stack points to (see "Inline */
+/* lookup" below). */
+
+/* With tc->trace_threshold set, a basic block's entry point decrements its */
+/* counter, and a hot stub just before the entry point calls the receiver when */
+/* the counter reaches zero: */
+
+/* | hot:   pop %rcx; lea -8(%rsp), %rsp; call *0(%rip); .quad receiver; ... */
+/*   entry: lea -128(%rsp), %rsp; push %rcx */
+/*          mov counter(%rip), %ecx; lea -1(%rcx), %ecx; mov %ecx, counter(%rip) */
+/*          jrcxz hot; pop %rcx; lea 128(%rsp), %rsp */
+
+/* The `lea` in the indirect sequences keeps us from clobbering the red zone, and */
+/* `push r/m` computes its address before %rsp changes, so only explicit */
+/* %rsp-relative operands need adjusting. */
+
+static xv_x64_insn const xv_x64_jmp32 = { .opcode = 0xe9 };
+
+static int xv_x64_emit_quad(xv_x64_ibuffer *const dst,
+                            void const     *const quad) {
+  if (xv_x64_sizingp(dst)) {
+    dst->current += 8;
+    return XV_WR_CONT;
+  }
+  if (dst->current + 8 > dst->start + dst->capacity) return XV_WR_END;
+  *(void const**) dst->current = quad;
+  dst->current += 8;
+  return XV_WR_CONT;
+}
+
+/* lea disp(%rsp), %rsp; leaves flags alone, unlike add/sub */
+static int xv_x64_emit_rsp_adjust(xv_x64_ibuffer *const dst,
+                                  int32_t         const disp) {
+  xv_x64_insn const lea = { .rex_w = 1, .opcode = 0x8d, .addr = XV_ADDR_BASE,
+                            .reg   = XV_RSP, .base = XV_RSP,
+                            .displacement = disp };
+  return xv_x64_write_insn(dst, &lea);
+}
+
+/* call *0(%rip); .quad receiver; .quad exit */
+static int xv_x64_emit_exit_call(xv_x64_ibuffer *const dst,
+                                 xv_x64_exit    *const exit) {
+  xv_x64_insn const call = { .opcode = 0xff, .reg = 2,
+                             .addr   = XV_ADDR_RIPREL };
+  int status;
+  if (status = xv_x64_write_insn(dst, &call)) return status;
+  if (!xv_x64_sizingp(dst)) exit->quads = (void const**) dst->current;
+  if (status = xv_x64_emit_quad(dst, (void const*) xv_x64_exit_receiver))
+    return status;
+  return xv_x64_emit_quad(dst, exit);
+}
+
+/* Record a field that depends on where the program is (see "Images" in
+ * xv-x64.h). Sizing just counts, so that xv_x64_translate_path can check for
+ * room before it writes anything. */
+static void xv_x64_add_reloc(xv_x64_tcache        *const tc,
+                             xv_x64_ibuffer const *const dst,
+                             xv_x64_i const       *const field,
+                             unsigned              const kind,
+                             unsigned              const hi) {
+  if (!xv_x64_sizingp(dst) && tc->nrelocs < tc->reloc_capacity)
+    tc->relocs[tc->nrelocs] = (xv_x64_reloc) {
+      .offset = field - tc->rw.dst.start, .kind = kind, .hi = hi };
+  ++tc->nrelocs;
+}
+
+/* xv_x64_relocate_insn, and a relocation if the instruction refers to the
+ * program rather than to this cache's own memory. */
+static int xv_x64_emit_relocated(xv_x64_tcache  *const tc,
+                                 xv_x64_ibuffer *const dst,
+                                 xv_x64_insn    *const insn) {
+  xv_x64_insn_encoding const enc =
+    xv_x64_insn_encodings[xv_x64_insn_key(insn)];
+  int const riprel = enc & XV_MODRM_MASK && insn->addr == XV_ADDR_RIPREL;
+  int const relimm = xv_x64_immrelp(insn);
+
+  xv_x64_const_i *const target = (xv_x64_const_i*) insn->rip
+                               + (riprel ? insn->displacement
+                                         : insn->immediate);
+  xv_x64_const_i *const cache  = (xv_x64_const_i*) tc->shared;
+  int status;
+
+  if (status = xv_x64_relocate_insn(dst, insn)) return status;
+  if (riprel || relimm)
+    if (target < cache || target >= tc->rw.dst.start + tc->rw.dst.capacity)
+      xv_x64_add_reloc(tc, dst, dst->current - 4
+                                - (riprel ? xv_x64_immediate_bytes(insn) : 0),
+                       XV_X64_RELOC_REL32, 0);
+  return XV_WR_CONT;
+}
+
+/* Push an original address as a quadword without touching registers or
+ * flags. push imm32 sign-extends, so it only works for low addresses. */
+static int xv_x64_emit_push_address(xv_x64_tcache  *const tc,
+                                    xv_x64_ibuffer *const dst,
+                                    void const     *const address) {
+  int64_t const a = (intptr_t) address;
+  int status;
+
+  if (!xv_overflowp(a, 32)) {
+    xv_x64_insn const push = { .opcode = 0x68, .immediate = a };
+    if (status = xv_x64_write_insn(dst, &push)) return status;
+    xv_x64_add_reloc(tc, dst, dst->current - 4, XV_X64_RELOC_ABS32, 0);
+    return XV_WR_CONT;
+  }
+
+  xv_x64_insn const lo = { .opcode = 0xc7, .addr = XV_ADDR_BASE,
+                           .base   = XV_RSP,
+                           .immediate = a & 0xffffffff };
+  xv_x64_insn const hi = { .opcode = 0xc7, .addr = XV_ADDR_BASE,
+                           .base   = XV_RSP, .displacement = 4,
+                           .immediate = a >> 32 & 0xffffffff };
+
+  if (status = xv_x64_emit_rsp_adjust(dst, -8)) return status;
+  if (status = xv_x64_write_insn(dst, &lo))     return status;
+  xv_x64_i *const lo_field = dst->current - 4;
+  if (status = xv_x64_write_insn(dst, &hi))     return status;
+  xv_x64_add_reloc(tc, dst, lo_field, XV_X64_RELOC_ABS64,
+                   dst->current - 4 - lo_field);
+  return XV_WR_CONT;
+}
+
+/* Pad with nops until dst->current + skew is a multiple of align. */
+static int xv_x64_emit_align(xv_x64_ibuffer *const dst,
+                             unsigned        const skew,
+                             unsigned        const align) {
+  xv_x64_insn const nop = { .opcode = 0x90 };
+  int status;
+  while ((intptr_t) (dst->current + skew) & align - 1)
+    if (status = xv_x64_write_insn(dst, &nop)) return status;
+  return XV_WR_CONT;
+}
+
+/* Write a rel32 jump (or jcc) and record it as a direct exit to target. The
+ * rel32 gets filled in when we emit the stubs, and it's 4-byte aligned so that
+ * xv_x64_link can patch it while other threads run it. */
+static int xv_x64_emit_direct_exit(xv_x64_tcache     *const tc,
+                                   xv_x64_ibuffer    *const dst,
+                                   xv_x64_block      *const block,
+                                   xv_x64_insn const *const jmp,
+                                   void const        *const target) {
+  int status;
+  if (status = xv_x64_emit_align(dst,
+                                 xv_x64_write_insn(NULL, jmp) - 4, 4))
+    return status;
+  if (status = xv_x64_write_insn(dst, jmp)) return status;
+
+  xv_x64_exit *const exit = &block->exits[block->nexits++];
+  exit->tc      = tc;
+  exit->target  = target;
+  exit->site    = (int32_t*) (dst->current - 4);
+  exit->kind    = XV_X64_EXIT_BRANCH;
+  exit->returns = 0;
+  return XV_WR_CONT;
+}
+
+/* Write a sequence of instructions, relocating any that refer to absolute
+ * addresses through their rip field. */
+static int xv_x64_emit_insns(xv_x64_tcache     *const tc,
+                             xv_x64_ibuffer    *const dst,
+                             xv_x64_insn const *const insns,
+                             unsigned           const n) {
+  int status;
+  for (unsigned i = 0; i < n; ++i) {
+    xv_x64_insn insn = insns[i];
+    if (status = xv_x64_emit_relocated(tc, dst, &insn)) return status;
+  }
+  return XV_WR_CONT;
+}
+
+/* jcc/jmp rel8 to a label we haven't emitted yet. The caller lands it with
+ * xv_x64_land8 once dst->current gets to the label. */
+static int xv_x64_emit_forward8(xv_x64_ibuffer *const dst,
+                                unsigned        const opcode,
+                                int8_t        **const site) {
+  xv_x64_insn const jump = { .opcode = opcode };
+  int const status = xv_x64_write_insn(dst, &jump);
+  *site = (int8_t*) dst->current - 1;
+  return status;
+}
+
+static inline void xv_x64_land8(xv_x64_ibuffer const *const dst,
+                                int8_t               *const site) {
+  if (!xv_x64_sizingp(dst))
+    *site = dst->current - (xv_x64_i*) (site + 1);
+}
+
+/* Inline lookup. */
+/* Indirect branches look up their targets without leaving translated code. The */
+/* lookup runs below the red zone with the target in the slot that the exit */
+/* receiver would use, and it needs three registers. It also needs to compare */
+/* things, so we stash the flags in %ax: lahf gets SF, ZF, AF, PF, and CF, and */
+/* seto gets OF. On the way out, `add $0x7f, %al` overflows exactly when OF was */
+/* set, and sahf restores the rest. This is much cheaper than pushfq/popfq. */
+
+/* | lea -128(%rsp), %rsp; push target           <- same as the exit protocol */
+/*   push %rax; push %rcx; push %rdx; lahf; seto %al */
+/*   (ret only: check and pop the shadow stack) */
+/*   hash target; cmp with table slot; jne miss */
+/*   found:  mov code, 24(%rsp); restore; ret $128 */
+/*   miss:   restore; call *0(%rip); .quad receiver; .quad exit */
+
+/* The probe only looks at the first slot the target hashes to; the table is at */
+/* most half full, so that's usually the right one, and anything else is the */
+/* receiver's problem. The found path leaves the way the exit receiver does: */
+/* `ret $128` takes the target from the slot and gives back the red zone in one */
+/* instruction, so the target is never below %rsp, where a signal frame could */
+/* overwrite it. The return predictor gets that ret wrong, but a jmp through the */
+/* slot would have to read it after %rsp has moved past it. */
+
+/* Calls push a shadow stack entry with the original return address and a */
+/* landing pad: a direct exit to the return address that follows the call's own */
+/* exit. Returns that match the top entry jump to the landing pad, which is */
+/* linked to the return block like any other direct exit. The shadow stack */
+/* belongs to the thread, so it's addressed through %gs (see "Threads" in */
+/* xv-x64.h). */
+
+static int xv_x64_emit_probe_save(xv_x64_tcache  *const tc,
+                                  xv_x64_ibuffer *const dst) {
+  xv_x64_insn const save[] = {
+    { .opcode = 0x50 | XV_RAX },
+    { .opcode = 0x50 | XV_RCX },
+    { .opcode = 0x50 | XV_RDX },
+    { .opcode = 0x9f },                                         /* lahf */
+    { .escape = XV_INSN_ESC1, .opcode = 0x90,                   /* seto %al */
+      .addr   = XV_ADDR_REG,  .base   = XV_RAX },
+  };
+  return xv_x64_emit_insns(tc, dst, save, sizeof(save) / sizeof(*save));
+}
+
+static int xv_x64_emit_probe_restore(xv_x64_tcache  *const tc,
+                                     xv_x64_ibuffer *const dst) {
+  xv_x64_insn const restore[] = {
+    { .opcode = 0x04, .immediate = 0x7f },                      /* add %al */
+    { .opcode = 0x9e },                                         /* sahf */
+    { .opcode = 0x58 | XV_RDX },
+    { .opcode = 0x58 | XV_RCX },
+    { .opcode = 0x58 | XV_RAX },
+  };
+  return xv_x64_emit_insns(tc, dst, restore,
+                           sizeof(restore) / sizeof(*restore));
+}
+
+#define XV_X64_SHADOW_TOP __builtin_offsetof(xv_x64_thread, shadow_top)
+#define XV_X64_SHADOW     __builtin_offsetof(xv_x64_thread, shadow)
+
+/* Push a shadow stack entry for a call that returns to orig_return. The
+ * landing pad doesn't exist yet, so *landing gets the rel32 to point at it. */
+static int xv_x64_emit_shadow_push(xv_x64_tcache  *const tc,
+                                   xv_x64_ibuffer *const dst,
+                                   void const     *const orig_return,
+                                   int32_t       **const landing) {
+  xv_x64_insn const push[] = {
+    { .opcode = 0xfe, .reg = 0, .p2 = XV_INSN_GS,               /* incb top */
+      .addr   = XV_ADDR_ZEROREL, .displacement = XV_X64_SHADOW_TOP },
+    { .escape = XV_INSN_ESC1,   .opcode = 0xb6, .reg = XV_RCX,  /* movzbl */
+      .p2     = XV_INSN_GS,
+      .addr   = XV_ADDR_ZEROREL, .displacement = XV_X64_SHADOW_TOP },
+    { .opcode = 0xc1, .reg  = 4, .immediate = 4,                /* shl $4 */
+      .addr   = XV_ADDR_REG,    .base = XV_RCX },
+    { .rex_w  = 1, .opcode = 0x8d, .reg = XV_RDX,               /* lea */
+      .addr   = XV_ADDR_RIPREL, .rip = orig_return },
+    { .rex_w  = 1, .opcode = 0x89, .reg = XV_RDX,               /* ->orig */
+      .p2     = XV_INSN_GS,
+      .addr   = XV_ADDR_BASE,   .base = XV_RCX,
+      .displacement = XV_X64_SHADOW },
+  };
+  xv_x64_insn const code[] = {
+    { .rex_w  = 1, .opcode = 0x8d, .reg = XV_RDX,               /* lea */
+      .addr   = XV_ADDR_RIPREL, .rip = dst->current },
+    { .rex_w  = 1, .opcode = 0x89, .reg = XV_RDX,               /* ->code */
+      .p2     = XV_INSN_GS,
+      .addr   = XV_ADDR_BASE,   .base = XV_RCX,
+      .displacement = XV_X64_SHADOW + 8 },
+  };
+  int status;
+
+  if (status = xv_x64_emit_insns(tc, dst, push,
+                                 sizeof(push) / sizeof(*push)))
+    return status;
+  if (status = xv_x64_emit_insns(tc, dst, code, 1)) return status;
+  *landing = (int32_t*) dst->current - 1;
+  return xv_x64_emit_insns(tc, dst, code + 1, 1);
+}
+
+/* Point a shadow entry's code at a new landing pad for orig_return. */
+static int xv_x64_emit_landing(xv_x64_tcache  *const tc,
+                               xv_x64_ibuffer *const dst,
+                               xv_x64_block   *const block,
+                               int32_t        *const landing,
+                               void const     *const orig_return) {
+  if (!xv_x64_sizingp(dst))
+    *landing = dst->current - (xv_x64_i*) (landing + 1);
+  return xv_x64_emit_direct_exit(tc, dst, block, &xv_x64_jmp32, orig_return);
+}
+
+/* Everything after the save: find the target's translation and jump to it,
+ * or call the receiver. */
+static int xv_x64_emit_lookup(xv_x64_tcache  *const tc,
+                              xv_x64_ibuffer *const dst,
+                              xv_x64_block   *const block,
+                              int             const shadow) {
+  xv_x64_tcache_shared *const shared = tc->shared;
+  xv_x64_insn const pop[] = {
+    { .escape = XV_INSN_ESC1,   .opcode = 0xb6, .reg = XV_RCX,  /* movzbl */
+      .p2     = XV_INSN_GS,
+      .addr   = XV_ADDR_ZEROREL, .displacement = XV_X64_SHADOW_TOP },
+    { .opcode = 0xfe, .reg = 1, .p2 = XV_INSN_GS,               /* decb top */
+      .addr   = XV_ADDR_ZEROREL, .displacement = XV_X64_SHADOW_TOP },
+    { .opcode = 0xc1, .reg  = 4, .immediate = 4,                /* shl $4 */
+      .addr   = XV_ADDR_REG,    .base = XV_RCX },
+    { .rex_w  = 1, .opcode = 0x8b, .reg = XV_RDX,               /* orig-> */
+      .p2     = XV_INSN_GS,
+      .addr   = XV_ADDR_BASE,   .base = XV_RCX,
+      .displacement = XV_X64_SHADOW },
+    { .rex_w  = 1, .opcode = 0x3b, .reg = XV_RDX,               /* cmp */
+      .addr   = XV_ADDR_BASE,   .base = XV_RSP, .displacement = 24 },
+  };
+  xv_x64_insn const probe[] = {
+    { .rex_w  = 1, .opcode = 0x8b, .reg = XV_RDX,               /* target */
+      .addr   = XV_ADDR_BASE,   .base = XV_RSP, .displacement = 24 },
+    { .opcode = 0x69, .reg  = XV_RCX,                           /* imul */
+      .addr   = XV_ADDR_REG,    .base = XV_RDX,
+      .immediate = (int32_t) 0x9e3779b1u },
+    { .opcode = 0xc1, .reg  = 5, .immediate = 32 - tc->table_bits,
+      .addr   = XV_ADDR_REG,    .base = XV_RCX },               /* shr */
+    { .opcode = 0xc1, .reg  = 4, .immediate = 4,                /* shl $4 */
+      .addr   = XV_ADDR_REG,    .base = XV_RCX },
+    { .rex_w  = 1, .opcode = 0x03, .reg = XV_RCX,               /* add */
+      .addr   = XV_ADDR_RIPREL, .rip = &shared->table },
+    { .rex_w  = 1, .opcode = 0x3b, .reg = XV_RDX,               /* cmp */
+      .addr   = XV_ADDR_BASE,   .base = XV_RCX },
+  };
+  xv_x64_insn const code = { .rex_w = 1, .opcode = 0x8b, .reg = XV_RCX,
+                             .addr  = XV_ADDR_BASE, .base = XV_RCX,
+                             .displacement = 8 };
+  xv_x64_insn const shadow_code = { .rex_w = 1, .opcode = 0x8b,
+                                    .reg   = XV_RCX, .p2 = XV_INSN_GS,
+                                    .addr  = XV_ADDR_BASE, .base = XV_RCX,
+                                    .displacement = XV_X64_SHADOW + 8 };
+  xv_x64_insn const found[] = {
+    { .rex_w  = 1, .opcode = 0x89, .reg = XV_RCX,               /* ->slot */
+      .addr   = XV_ADDR_BASE,   .base = XV_RSP, .displacement = 24 },
+  };
+  xv_x64_insn const leave = { .opcode = 0xc2,                   /* ret $n */
+                              .immediate = XV_X64_EXIT_STACK - 8 };
+
+  int8_t *shadow_miss = NULL, *shadow_hit = NULL, *miss;
+  int     status;
+
+  xv_x64_exit *const exit = &block->exits[block->nexits++];
+  exit->tc      = tc;
+  exit->target  = NULL;
+  exit->site    = NULL;
+  exit->kind    = XV_X64_EXIT_BRANCH;
+  exit->returns = shadow;
+
+  if (shadow) {
+    if (status = xv_x64_emit_insns(tc, dst, pop,
+                                   sizeof(pop) / sizeof(*pop)))
+      return status;
+    if (status = xv_x64_emit_forward8(dst, 0x75, &shadow_miss)) return status;
+    if (status = xv_x64_emit_insns(tc, dst, &shadow_code, 1))   return status;
+    if (status = xv_x64_emit_forward8(dst, 0xeb, &shadow_hit))  return status;
+    xv_x64_land8(dst, shadow_miss);
+  }
+
+  if (status = xv_x64_emit_insns(tc, dst, probe,
+                                 sizeof(probe) / sizeof(*probe)))
+    return status;
+  if (status = xv_x64_emit_forward8(dst, 0x75, &miss)) return status;
+  if (status = xv_x64_emit_insns(tc, dst, &code, 1))   return status;
+
+  if (shadow_hit) xv_x64_land8(dst, shadow_hit);
+  if (status = xv_x64_emit_insns(tc, dst, found, 1)) return status;
+  if (status = xv_x64_emit_probe_restore(tc, dst))   return status;
+  if (status = xv_x64_write_insn(dst, &leave))       return status;
+
+  xv_x64_land8(dst, miss);
+  if (status = xv_x64_emit_probe_restore(tc, dst)) return status;
+  return xv_x64_emit_exit_call(dst, exit);
+}
+
+/* push r/m for jmp *r/m or call *r/m. rsp_bias is how far %rsp has moved
+ * since the original instruction would have computed its operand. */
+static int xv_x64_emit_push_target(xv_x64_tcache     *const tc,
+                                   xv_x64_ibuffer    *const dst,
+                                   xv_x64_insn const *const insn,
+                                   int32_t            const rsp_bias) {
+  xv_x64_insn push = *insn;
+  int         status;
+
+  push.reg = 6;
+  if (push.addr != XV_ADDR_REG && push.addr != XV_ADDR_RIPREL
+      && push.addr != XV_ADDR_ZEROREL && !push.nobase
+      && push.base == XV_RSP)
+    push.displacement += rsp_bias;
+
+  if (status = xv_x64_emit_rsp_adjust(dst, -128)) return status;
+  return xv_x64_emit_relocated(tc, dst, &push);
+}
+
+static int xv_x64_emit_branch(xv_x64_tcache     *const tc,
+                              xv_x64_ibuffer    *const dst,
+                              xv_x64_block      *const block,
+                              xv_x64_insn const *const insn,
+                              int                const branch) {
+  void const     *const target = (xv_x64_const_i*) insn->rip
+                               + insn->immediate;
+  int32_t *landing;
+  int      status;
+
+  switch (branch) {
+    case XV_BRANCH_JMP:
+      return xv_x64_emit_direct_exit(tc, dst, block, &xv_x64_jmp32, target);
+
+    case XV_BRANCH_JCC: {
+      xv_x64_insn const jcc = { .escape = XV_INSN_ESC1,
+                                .opcode = 0x80 | insn->opcode & 0x0f };
+      if (status = xv_x64_emit_direct_exit(tc, dst, block, &jcc, target))
+        return status;
+      return xv_x64_emit_direct_exit(tc, dst, block, &xv_x64_jmp32,
+                                     insn->rip);
+    }
+
+    case XV_BRANCH_LOOP: {
+      xv_x64_insn loop = *insn;
+      int8_t     *skip;
+      loop.immediate = 2;
+      if (status = xv_x64_write_insn(dst, &loop))           return status;
+      if (status = xv_x64_emit_forward8(dst, 0xeb, &skip)) return status;
+      if (status = xv_x64_emit_direct_exit(tc, dst, block, &xv_x64_jmp32,
+                                           target))
+        return status;
+      xv_x64_land8(dst, skip);
+      return xv_x64_emit_direct_exit(tc, dst, block, &xv_x64_jmp32,
+                                     insn->rip);
+    }
+
+    case XV_BRANCH_CALL:
+      if (status = xv_x64_emit_push_address(tc, dst, insn->rip)) return status;
+      if (status = xv_x64_emit_rsp_adjust(dst, -128))            return status;
+      if (status = xv_x64_emit_probe_save(tc, dst))              return status;
+      if (status = xv_x64_emit_shadow_push(tc, dst, insn->rip, &landing))
+        return status;
+      if (status = xv_x64_emit_probe_restore(tc, dst))           return status;
+      if (status = xv_x64_emit_rsp_adjust(dst, 128))             return status;
+      if (status = xv_x64_emit_direct_exit(tc, dst, block, &xv_x64_jmp32,
+                                           target))
+        return status;
+      return xv_x64_emit_landing(tc, dst, block, landing, insn->rip);
+
+    case XV_BRANCH_RET: {
+      int32_t const n = insn->opcode == 0xc2 ? insn->immediate : 0;
+      xv_x64_insn const push = { .opcode = 0xff, .reg = 6,
+                                 .addr   = XV_ADDR_BASE, .base = XV_RSP,
+                                 .displacement = 128 - 8 - n };
+
+      if (status = xv_x64_emit_rsp_adjust(dst, 8 + n - 128)) return status;
+      if (status = xv_x64_write_insn(dst, &push))             return status;
+      if (status = xv_x64_emit_probe_save(tc, dst))           return status;
+      return xv_x64_emit_lookup(tc, dst, block, 1);
+    }
+
+    case XV_BRANCH_IJMP:
+      if (status = xv_x64_emit_push_target(tc, dst, insn, 128)) return status;
+      if (status = xv_x64_emit_probe_save(tc, dst))             return status;
+      return xv_x64_emit_lookup(tc, dst, block, 0);
+
+    case XV_BRANCH_ICALL:
+      if (status = xv_x64_emit_push_address(tc, dst, insn->rip)) return status;
+      if (status = xv_x64_emit_push_target(tc, dst, insn, 128 + 8))
+        return status;
+      if (status = xv_x64_emit_probe_save(tc, dst))              return status;
+      if (status = xv_x64_emit_shadow_push(tc, dst, insn->rip, &landing))
+        return status;
+      if (status = xv_x64_emit_lookup(tc, dst, block, 0))        return status;
+      return xv_x64_emit_landing(tc, dst, block, landing, insn->rip);
+
+    default:
+      return XV_WR_INV;
+  }
+}
+
+/* Syscall sites. */
+/* See "Syscalls" in xv-x64.h. `syscall` clobbers %rcx and %r11, so the counter */
+/* and the policy check can use them without saving anything, and neither one */
+/* touches the flags: */
+
+/* | mov syscalls(%rip), %rcx; lea 1(%rcx), %rcx; mov %rcx, syscalls(%rip) */
+/*   lea policy(%rip), %r11 */
+/*   movzwl %ax, %ecx */
+/*   movzbl (%r11,%rcx), %ecx */
+/*   jrcxz native */
+/*   lea -136(%rsp), %rsp; call *0(%rip); .quad receiver; .quad exit */
+/*   native: syscall */
+/*   done: */
+
+/* The receiver comes back to either native or done, depending on whether the */
+/* handler wants the syscall to run. `int $0x80` and `sysenter` skip everything */
+/* up to the `lea`, so they always call the receiver and don't touch %rcx. */
+
+static inline int xv_x64_routed_syscallp(xv_x64_insn const *const insn) {
+  return !insn->vex && !insn->xop && xv_x64_syscallp(insn);
+}
+
+static int xv_x64_emit_syscall(xv_x64_tcache     *const tc,
+                               xv_x64_ibuffer    *const dst,
+                               xv_x64_block      *const block,
+                               xv_x64_insn const *const insn) {
+  int32_t const count = __builtin_offsetof(xv_x64_thread, stats.syscalls);
+  xv_x64_insn const route[] = {
+    { .rex_w  = 1, .opcode = 0x8b, .reg = XV_RCX,               /* mov */
+      .p2     = XV_INSN_GS,
+      .addr   = XV_ADDR_ZEROREL, .displacement = count },
+    { .rex_w  = 1, .opcode = 0x8d, .reg = XV_RCX,               /* lea 1 */
+      .addr   = XV_ADDR_BASE,   .base = XV_RCX, .displacement = 1 },
+    { .rex_w  = 1, .opcode = 0x89, .reg = XV_RCX,               /* mov */
+      .p2     = XV_INSN_GS,
+      .addr   = XV_ADDR_ZEROREL, .displacement = count },
+    { .rex_w  = 1, .opcode = 0x8d, .reg = 11,                   /* lea */
+      .addr   = XV_ADDR_RIPREL, .rip = tc->shared->syscall_policy },
+    { .escape = XV_INSN_ESC1,   .opcode = 0xb7, .reg = XV_RCX,  /* movzwl */
+      .addr   = XV_ADDR_REG,    .base = XV_RAX },
+    { .escape = XV_INSN_ESC1,   .opcode = 0xb6, .reg = XV_RCX,  /* movzbl */
+      .addr   = XV_ADDR_SCALE1, .base = 11, .index = XV_RCX },
+  };
+  int const fast   = insn->escape == XV_INSN_ESC1 && insn->opcode == 0x05;
+  int8_t   *native = NULL;
+  int       status;
+
+  xv_x64_exit *const exit = &block->exits[block->nexits++];
+  exit->tc      = tc;
+  exit->target  = insn->rip;
+  exit->site    = NULL;
+  exit->kind    = fast ? XV_X64_EXIT_SYSCALL : XV_X64_EXIT_SYSCALL32;
+  exit->returns = 0;
+
+  if (fast) {
+    if (status = xv_x64_emit_insns(tc, dst, route,
+                                   sizeof(route) / sizeof(*route)))
+      return status;
+    if (status = xv_x64_emit_forward8(dst, 0xe3, &native)) return status;
+  }
+  if (status = xv_x64_emit_rsp_adjust(dst, -XV_X64_EXIT_STACK))
+    return status;
+  if (status = xv_x64_emit_exit_call(dst, exit)) return status;
+  if (native) xv_x64_land8(dst, native);
+  return xv_x64_write_insn(dst, insn);
+}
+
+/* Each direct exit gets its own stub: lea -136(%rsp), %rsp; call receiver. */
+static int xv_x64_emit_exit_stubs(xv_x64_tcache  *const tc,
+                                  xv_x64_ibuffer *const dst,
+                                  xv_x64_block   *const block) {
+  int status;
+
+  for (unsigned i = 0; i < block->nexits; ++i) {
+    xv_x64_exit *const exit = &block->exits[i];
+    if (!exit->site) continue;
+
+    exit->stub = dst->current;
+    if (!xv_x64_sizingp(dst)) xv_x64_link(exit, dst->current);
+    if (status = xv_x64_emit_rsp_adjust(dst, -XV_X64_EXIT_STACK))
+      return status;
+    if (status = xv_x64_emit_exit_call(dst, exit)) return status;
+  }
+  return XV_WR_CONT;
+}
+
+/* read_insn keeps only the first segment prefix, but the CPU uses the last. */
+static int xv_x64_gs_prefixp(xv_x64_const_i       *p,
+                             xv_x64_const_i *const end) {
+  for (; p < end && xv_x64_byte_classes[*p] == XV_BYTE_LEGACY; ++p)
+    if (*p == 0x65) return 1;
+  return 0;
+}
+
+/* Copy and relocate instructions from src up to the end of a block. *end gets
+ * the branch that ended it (which is left in *insn), XV_X64_END_SYSCALL, or
+ * XV_BRANCH_NONE if the block just stops and should fall through to src. */
+static int xv_x64_emit_body(xv_x64_tcache        *const tc,
+                            xv_x64_ibuffer       *const dst,
+                            xv_x64_const_ibuffer *const src,
+                            xv_x64_insn          *const insn,
+                            int                  *const end) {
+  xv_x64_const_i *const start  = src->current;
+  int             const sizing = xv_x64_sizingp(dst);
+
+  int status  = XV_RW_CONT;
+  int branch  = XV_BRANCH_NONE;
+  int segment = 0;
+
+  *end = XV_BRANCH_NONE;
+
+  for (unsigned n = 0; n < XV_X64_BLOCK_INSNS; ++n) {
+    /* Most instructions don't care where they are, so we can just copy them
+     * once we know how long they are. */
+    unsigned       flags  = 0;
+    unsigned const length = src->start + src->capacity - src->current >= 15
+                          ? xv_x64_scan_insn(src->current, &flags)
+                          : 0;
+
+    if (length && flags == XV_SCAN_COPY) {
+      if (!sizing) {
+        if (dst->current + length > dst->start + dst->capacity) {
+          status = XV_WR_END | XV_RW_W;
+          break;
+        }
+        memcpy(dst->current, src->current, length);
+      }
+      dst->current += length;
+      src->current += length;
+      continue;
+    }
+
+    xv_x64_const_ibuffer next = *src;
+    if (status = xv_x64_read_insn(&next, insn)) {
+      status |= XV_RW_R;
+      break;
+    }
+
+    /* %gs is the thread's xv_x64_thread, not the program's. */
+    if (segment = xv_x64_gs_prefixp(src->current, next.current)) break;
+
+    /* We can't push %rsp's pre-branch value, so jmp/call *%rsp stay out. */
+    if (branch = xv_x64_branchp(insn)) {
+      if (branch != XV_BRANCH_OTHER
+          && !(insn->addr == XV_ADDR_REG && insn->base == XV_RSP
+               && (branch == XV_BRANCH_IJMP || branch == XV_BRANCH_ICALL)))
+        *src = next, *end = branch;
+      break;
+    }
+
+    if (xv_x64_routed_syscallp(insn)) {
+      *src = next, *end = XV_X64_END_SYSCALL;
+      break;
+    }
+
+    xv_x64_i *const before = dst->current;
+    if (status = xv_x64_emit_relocated(tc, dst, insn)) {
+      dst->current = before;
+      status |= XV_RW_W;
+      break;
+    }
+    *src = next;
+  }
+
+  if (src->current == start && (status || branch || segment))
+    return status ? status : segment ? XV_TC_SEGMENT : XV_TC_BRANCH;
+  return XV_RW_CONT;
+}
+
+/* Whatever ended the body, translated as it would be at the end of a block;
+ * fall is where execution continues if it doesn't branch. */
+static int xv_x64_emit_end(xv_x64_tcache     *const tc,
+                           xv_x64_ibuffer    *const dst,
+                           xv_x64_block      *const block,
+                           xv_x64_insn const *const insn,
+                           int                const end,
+                           void const        *const fall) {
+  int status;
+  if (end != XV_BRANCH_NONE && end != XV_X64_END_SYSCALL)
+    return xv_x64_emit_branch(tc, dst, block, insn, end);
+  if (end == XV_X64_END_SYSCALL
+      && (status = xv_x64_emit_syscall(tc, dst, block, insn)))
+    return status;
+  return xv_x64_emit_direct_exit(tc, dst, block, &xv_x64_jmp32, fall);
+}
+
+/* A trace block branches to the next one in the path. Jumps and fall-throughs
+ * cost nothing; jcc becomes a side exit to whichever target isn't next. */
+static int xv_x64_emit_joint(xv_x64_tcache     *const tc,
+                             xv_x64_ibuffer    *const dst,
+                             xv_x64_block      *const block,
+                             xv_x64_insn const *const insn,
+                             int                const end,
+                             void const        *const next) {
+  if (end != XV_BRANCH_JCC) return XV_WR_CONT;
+
+  void const *const taken = (xv_x64_const_i*) insn->rip + insn->immediate;
+  unsigned    const cc    = insn->opcode & 0x0f;
+  xv_x64_insn const jcc   = { .escape = XV_INSN_ESC1,
+                              .opcode = 0x80 | (taken == next ? cc ^ 1 : cc) };
+  return xv_x64_emit_direct_exit(tc, dst, block, &jcc,
+                                 taken == next ? insn->rip : taken);
+}
+
+/* pop %rcx; lea -8(%rsp), %rsp; call receiver: the counter prologue jumps
+ * back here when it runs out. */
+static int xv_x64_emit_hot_stub(xv_x64_tcache  *const tc,
+                                xv_x64_ibuffer *const dst,
+                                xv_x64_block   *const block) {
+  xv_x64_insn const pop = { .opcode = 0x58 | XV_RCX };
+  int status;
+
+  xv_x64_exit *const exit = &block->exits[block->nexits++];
+  exit->tc      = tc;
+  exit->target  = block->start;
+  exit->site    = NULL;
+  exit->kind    = XV_X64_EXIT_HOT;
+  exit->returns = 0;
+
+  if (status = xv_x64_write_insn(dst, &pop))       return status;
+  if (status = xv_x64_emit_rsp_adjust(dst, -8))    return status;
+  return xv_x64_emit_exit_call(dst, exit);
+}
+
+/* Count down this block's counter without touching the flags. */
+static int xv_x64_emit_counter(xv_x64_tcache  *const tc,
+                               xv_x64_ibuffer *const dst,
+                               xv_x64_block   *const block,
+                               xv_x64_i       *const hot) {
+  uint32_t       *const counter = &tc->counters[block - tc->blocks];
+  xv_x64_insn const count[] = {
+    { .opcode = 0x50 | XV_RCX },                                /* push */
+    { .opcode = 0x8b, .reg = XV_RCX,                            /* mov */
+      .addr   = XV_ADDR_RIPREL, .rip = counter },
+    { .opcode = 0x8d, .reg = XV_RCX,                            /* lea -1 */
+      .addr   = XV_ADDR_BASE,   .base = XV_RCX, .displacement = -1 },
+    { .opcode = 0x89, .reg = XV_RCX,                            /* mov */
+      .addr   = XV_ADDR_RIPREL, .rip = counter },
+  };
+  xv_x64_insn const pop = { .opcode = 0x58 | XV_RCX };
+  int status;
+
+  if (status = xv_x64_emit_rsp_adjust(dst, -128)) return status;
+  if (status = xv_x64_emit_insns(tc, dst, count,
+                                 sizeof(count) / sizeof(*count)))
+    return status;
+
+  xv_x64_insn const jrcxz = { .opcode = 0xe3,
+                              .immediate = hot - (dst->current + 2) };
+  if (status = xv_x64_write_insn(dst, &jrcxz)) return status;
+  if (status = xv_x64_write_insn(dst, &pop))   return status;
+  return xv_x64_emit_rsp_adjust(dst, 128);
+}
+
+/* Translate the n blocks starting at path into dst: a basic block if n is 1,
+ * otherwise a trace. Against a sizing buffer this stores nothing, but still
+ * advances dst->current by exactly as much. */
+static int xv_x64_emit_block(xv_x64_tcache     *const tc,
+                             xv_x64_ibuffer    *const dst,
+                             xv_x64_block      *const block,
+                             void const *const *const path,
+                             unsigned           const n) {
+  xv_x64_const_ibuffer src = tc->rw.src;
+
+  xv_x64_insn insn;
+  int         status;
+  int         end;
+
+  block->nexits = 0;
+  block->length = n;
+
+  if (n == 1 && tc->trace_threshold) {
+    xv_x64_i *const hot = dst->current;
+    if (status = xv_x64_emit_hot_stub(tc, dst, block))
+      return XV_RW_W | status;
+    if (status = xv_x64_emit_align(dst, 0, 8))
+      return XV_RW_W | status;
+    block->code = dst->current;
+    if (!xv_x64_sizingp(dst))
+      tc->counters[block - tc->blocks] = tc->trace_threshold;
+    if (status = xv_x64_emit_counter(tc, dst, block, hot))
+      return XV_RW_W | status;
+  } else
+    block->code = dst->current;
+
+  for (unsigned i = 0;; ++i) {
+    src.current = src.start + ((xv_x64_const_i*) path[i]
+                               - src.logical_start);
+    if (status = xv_x64_emit_body(tc, dst, &src, &insn, &end)) return status;
+    if (i + 1 == n) break;
+    if (status = xv_x64_emit_joint(tc, dst, block, &insn, end, path[i + 1]))
+      return XV_RW_W | status;
+  }
+
+  void const *const fall = src.current - src.start + src.logical_start;
+  if ((status = xv_x64_emit_end(tc, dst, block, &insn, end, fall))
+      || (status = xv_x64_emit_exit_stubs(tc, dst, block)))
+    return XV_RW_W | status;
+
+  block->end    = fall;
+  block->branch = end;
+  return XV_TC_OK;
+}
+
+static unsigned xv_x64_tcache_reprotect(xv_x64_tcache *tc,
+                                        void const    *start,
+                                        void const    *end);
+
+static int xv_x64_translate_path(xv_x64_tcache     *const tc,
+                                 void const *const *const path,
+                                 unsigned           const n,
+                                 xv_x64_i         **const code) {
+  xv_x64_ibuffer *const dst    = &tc->rw.dst;
+  xv_x64_ibuffer        sizer  = *dst;
+  xv_x64_i       *const here   = dst->current;
+  unsigned        const relocs = tc->nrelocs;
+  uint64_t        const t0     = __builtin_ia32_rdtsc();
+  int status;
+
+  if (tc->nblocks >= tc->block_capacity
+      || 2 * (tc->map->count + 1) > 1u << tc->table_bits)
+    return XV_TC_FULL;
+
+  xv_x64_block *const block = &tc->blocks[tc->nblocks];
+  block->start = path[0];
+
+  /* Size the block first, so that we never have to throw away a partial
+   * translation when the arena runs out. Sizing only costs a scan for most
+   * instructions, since copied ones don't need decoding. */
+  sizer.sizing = 1;
+  status = xv_x64_emit_block(tc, &sizer, block, path, n);
+
+  /* A block from a page that we made writable makes it code again, so
+   * protect the page before we trust what we read from it. Sizing tells us
+   * which pages the block covers; if any were writable, read them again. */
+  if (!status && tc->map->nwritable && n == 1
+      && xv_x64_tcache_reprotect(tc, block->start, block->end)) {
+    sizer.current = dst->current;
+    tc->nrelocs   = relocs;
+    status        = xv_x64_emit_block(tc, &sizer, block, path, n);
+  }
+  if (!status && (sizer.current > dst->start + dst->capacity
+                  || tc->nrelocs > tc->reloc_capacity))
+    status = XV_TC_FULL;
+  tc->nrelocs = relocs;
+  if (status) return status;
+
+  if (status = xv_x64_emit_block(tc, dst, block, path, n)) {
+    dst->current = here;
+    tc->nrelocs  = relocs;
+    return status;
+  }
+
+  xv_x64_tcache_insert(tc, path[0], block->code);
+  xv_x64_index_insert(tc, tc->nblocks++);
+
+  /* Link to anything that's already here, including ourselves. */
+  for (unsigned i = 0; i < block->nexits; ++i) {
+    xv_x64_exit *const exit = &block->exits[i];
+    xv_x64_i    *target_code;
+    if (exit->site && (target_code = xv_x64_tcache_lookup(tc, exit->target)))
+      xv_x64_link(exit, target_code);
+  }
+
+  /* Only the cache's own thread translates into it (or xv, with the group
+   * stopped), so its counters are the owner's. */
+  xv_x64_stats *const stats = &tc->shared->thread.stats;
+  stats->blocks           += 1;
+  stats->traces           += n > 1;
+  stats->translate_cycles += __builtin_ia32_rdtsc() - t0;
+
+  *code = block->code;
+  return XV_TC_OK;
+}
+
+int xv_x64_translate(xv_x64_tcache *const tc,
+                     void const    *const orig,
+                     xv_x64_i     **const code) {
+  intptr_t const offset = (xv_x64_const_i*) orig - tc->rw.src.logical_start;
+  if (offset < 0 || offset >= tc->rw.src.capacity) return XV_TC_RANGE;
+  return xv_x64_translate_path(tc, &orig, 1, code);
+}
+
+/* Traces. */
+/* A block's counter starts at tc->trace_threshold and counts down, so */
+/* threshold - counter is how many times it has run (the subtraction also works */
+/* after the counter wraps). From the hot block, we keep moving to whichever */
+/* direct successor has run the most, stopping at anything that isn't a basic */
+/* block ending in jmp, jcc, or a fall-through, and at anything already on the */
+/* path. Loops therefore end up as a trace whose last exit links back to its own */
+/* entry. */
+
+/* If we can't make a trace (only one block qualifies, or the cache is full), */
+/* the hot block keeps running as it is. Its counter wraps, so we won't try */
+/* again for a long time. */
+
+static inline uint32_t xv_x64_block_runs(xv_x64_tcache const *const tc,
+                                         xv_x64_block  const *const block) {
+  return tc->trace_threshold - tc->counters[block - tc->blocks];
+}
+
+/* The block that the group currently runs for orig, if it's one of ours. */
+static xv_x64_block *xv_x64_tcache_block(xv_x64_tcache *const tc,
+                                         void const    *const orig) {
+  xv_x64_i     *const code  = xv_x64_tcache_lookup(tc, orig);
+  xv_x64_block *const block = code ? xv_x64_index_find(tc, orig) : NULL;
+  return block && block->code == code ? block : NULL;
+}
+
+static unsigned xv_x64_trace_path(xv_x64_tcache      *const tc,
+                                  xv_x64_block const *      block,
+                                  void const        **const path) {
+  unsigned n = 0;
+  path[n++] = block->start;
+
+  while (n < XV_X64_TRACE_BLOCKS
+         && (block->branch == XV_BRANCH_NONE
+             || block->branch == XV_BRANCH_JMP
+             || block->branch == XV_BRANCH_JCC)) {
+    xv_x64_block const *best = NULL;
+
+    for (unsigned i = 0; i < block->nexits; ++i) {
+      xv_x64_exit  const *const exit = &block->exits[i];
+      xv_x64_block const *const next = exit->site
+                                     ? xv_x64_tcache_block(tc, exit->target)
+                                     : NULL;
+      unsigned j = 0;
+      if (!next || next->length != 1) continue;
+      while (j < n && path[j] != next->start) ++j;
+      if (j == n && (!best || xv_x64_block_runs(tc, next)
+                              > xv_x64_block_runs(tc, best)))
+        best = next;
+    }
+
+    if (!best) break;
+    path[n++] = (block = best)->start;
+  }
+
+  return n;
+}
+
+/* The thread that's running translated code; see "Threads" in xv-x64.h. */
+static inline xv_x64_thread *xv_x64_thread_current(void) {
+  xv_x64_thread *thread;
+  asm volatile ("mov %%gs:0, %0" : "=r"(thread));
+  return thread;
+}
+
+/* The counter of the block that owns exit ran out; its hot exit is always the
+ * first one. */
+static void const *xv_x64_tcache_hot(xv_x64_exit *const exit) {
+  xv_x64_tcache *const tc    = exit->tc;
+  xv_x64_block  *const block = (xv_x64_block*)
+                               ((char*) exit - __builtin_offsetof(xv_x64_block,
+                                                                  exits));
+  void const *path[XV_X64_TRACE_BLOCKS];
+  unsigned    n = 0;
+  xv_x64_i   *code;
+
+  if (tc == xv_x64_thread_current()->tc)
+    n = xv_x64_trace_path(tc, block, path);
+
+  xv_x64_trace(0, "xv_x64_tcache_hot(%p): %u blocks\n", block->start, n);
+
+  if (n < 2 || xv_x64_translate_path(tc, path, n, &code)) return block->code;
+
+  /* Anything that still jumps to the block now goes to the trace. The block
+   * is 8-byte aligned and its counter prologue is longer than that, so one
+   * store replaces the first five bytes with a jmp. */
+  uint64_t *const head = (uint64_t*) block->code;
+  uint64_t  const rel  = (uint32_t) (code - (block->code + 5));
+  __atomic_store_n(head, *head & ~0xffffffffffull | rel << 8 | 0xe9,
+                   __ATOMIC_RELEASE);
+  return code;
+}
+
+/* Eviction. */
+/* See "Eviction" in xv-x64.h. Both collection and invalidation finish by */
+/* rebuilding the hash table from the live blocks of every cache in the group */
+/* and pointing every direct exit at whatever the table now says, or back at its */
+/* stub. Later blocks override earlier ones in the table, which keeps traces in */
+/* front of the blocks that started them. A group with more caches than its */
+/* table was sized for can have more live blocks than the table holds; the ones */
+/* that don't fit stay out of it, and their exits go through the dispatcher */
+/* until a miss finds the table full and xv makes room. */
+
+static void xv_x64_tcache_relink(xv_x64_tcache *const tc) {
+  xv_x64_tcache *c = tc;
+  xv_x64_tcache_clear(tc);
+
+  do
+    for (unsigned i = 0; i < c->nblocks; ++i)
+      if (c->blocks[i].code
+          && 2 * (c->map->count + 1) <= 1u << c->table_bits)
+        xv_x64_tcache_insert(c, c->blocks[i].start, c->blocks[i].code);
+  while ((c = c->next) != tc);
+
+  do
+    for (unsigned i = 0; i < c->nblocks; ++i)
+      for (unsigned j = 0; j < c->blocks[i].nexits; ++j) {
+        xv_x64_exit *const exit = &c->blocks[i].exits[j];
+        xv_x64_i    *code;
+        if (!exit->site) continue;
+        code = xv_x64_tcache_lookup(c, exit->target);
+        xv_x64_link(exit, code ? code : exit->stub);
+      }
+  while ((c = c->next) != tc);
+}
+
+static inline int xv_x64_survivorp(xv_x64_tcache const *const tc,
+                                   xv_x64_block  const *const block,
+                                   uint64_t             const min_runs) {
+  return block->code && block->length == 1
+      && xv_x64_block_runs(tc, block) >= min_runs;
+}
+
+/* Survivors are live basic blocks that have run at least min_runs times; we
+ * double min_runs until at most half of the group's blocks qualify. */
+void xv_x64_tcache_collect(xv_x64_tcache *const tc) {
+  uint64_t       min_runs = 1;
+  unsigned       n        = 0;
+  xv_x64_tcache *c        = tc;
+
+  for (; tc->trace_threshold; min_runs <<= 1) {
+    unsigned total = 0;
+    n = 0;
+    do {
+      for (unsigned i = 0; i < c->nblocks; ++i)
+        n += xv_x64_survivorp(c, &c->blocks[i], min_runs);
+      total += c->nblocks;
+    } while ((c = c->next) != tc);
+    if (2 * n <= total) break;
+  }
+
+  if (!n) {
+    xv_x64_tcache_flush(tc);
+    return;
+  }
+
+  /* Survivors' start addresses go to the front of each block array.
+   * Translating survivor i writes at most block i, so we read each one just
+   * before it gets overwritten. */
+  xv_x64_tcache_clear(tc);
+  do {
+    n = 0;
+    xv_x64_index_clear(c);
+    for (unsigned i = 0; i < c->nblocks; ++i)
+      if (xv_x64_survivorp(c, &c->blocks[i], min_runs))
+        c->blocks[n++].start = c->blocks[i].start;
+
+    c->rw.dst.current = c->rw.dst.start;
+    c->nblocks        = 0;
+    c->nrelocs        = 0;
+    ++c->collections;
+
+    for (unsigned i = 0; i < n; ++i) {
+      void const *const start = c->blocks[i].start;
+      xv_x64_i         *code;
+      if (xv_x64_translate(c, start, &code) == XV_TC_FULL) {
+        xv_x64_tcache_flush(tc);
+        return;
+      }
+    }
+  } while ((c = c->next) != tc);
+
+  xv_x64_tcache_relink(tc);
+}
+
+/* Every block in a trace is also a live basic block in the same cache, so a
+ * write that hits a trace always hits a basic block too. Traces aren't
+ * contiguous in the original code, so then we drop all of them, along with the
+ * blocks that jump to them. */
+void xv_x64_tcache_invalidate(xv_x64_tcache *const tc,
+                              void const    *const start,
+                              ssize_t        const size) {
+  xv_x64_const_i *const lo    = start;
+  xv_x64_const_i *const hi    = lo + size;
+  unsigned              found = 0;
+  xv_x64_tcache        *c     = tc;
+
+  do
+    for (unsigned i = 0; i < c->nblocks; ++i) {
+      xv_x64_block *const block = &c->blocks[i];
+      if (block->code && block->length == 1
+          && (xv_x64_const_i*) block->start < hi
+          && (xv_x64_const_i*) block->end   > lo) {
+        block->code = NULL;
+        ++found;
+      }
+    }
+  while ((c = c->next) != tc);
+  if (!found) return;
+
+  do
+    for (unsigned i = 0; i < c->nblocks; ++i)
+      if (c->blocks[i].length > 1) {
+        c->blocks[i].code = NULL;
+        for (unsigned j = 0; j < i; ++j)
+          if (c->blocks[j].start == c->blocks[i].start)
+            c->blocks[j].code = NULL;
+      }
+  while ((c = c->next) != tc);
+
+  xv_x64_tcache_relink(tc);
+}
+
+static inline void const *xv_x64_page(void const *const addr) {
+  return (void const*) ((intptr_t) addr & ~(PAGESIZE - 1));
+}
+
+static int xv_x64_mprotect(void const *const start,
+                           ssize_t     const size,
+                           int         const prot) {
+  return xv_syscall3(__NR_mprotect, (xv_register) start, size, prot);
+}
+
+int xv_x64_tcache_protect(xv_x64_tcache *const tc) {
+  xv_x64_const_i *const lo = xv_x64_page(tc->rw.src.logical_start);
+  xv_x64_const_i *const hi = tc->rw.src.logical_start + tc->rw.src.capacity;
+  for (unsigned i = 0; i < XV_X64_WRITABLE_PAGES; ++i)
+    tc->map->writable[i] = NULL;
+  tc->map->nwritable = 0;
+  return xv_x64_mprotect(lo, hi - lo, PROT_READ | PROT_EXEC);
+}
+
+/* Protect any writable pages that [start, end) touches, since we're about to
+ * translate from them again, and return how many there were. Other threads
+ * may be doing the same thing, so whoever takes a page out of the list
+ * protects it. */
+static unsigned xv_x64_tcache_reprotect(xv_x64_tcache *const tc,
+                                        void const    *const start,
+                                        void const    *const end) {
+  void const *const lo = xv_x64_page(start);
+  void const *const hi = xv_x64_page((xv_x64_const_i*) end - 1);
+  unsigned          n  = 0;
+
+  for (unsigned i = 0; i < XV_X64_WRITABLE_PAGES; ++i) {
+    void const *const page = __atomic_load_n(&tc->map->writable[i],
+                                             __ATOMIC_RELAXED);
+    if (page && page >= lo && page <= hi
+        && __atomic_exchange_n(&tc->map->writable[i], NULL,
+                               __ATOMIC_RELAXED) == page) {
+      xv_x64_mprotect(page, PAGESIZE, PROT_READ | PROT_EXEC);
+      __atomic_sub_fetch(&tc->map->nwritable, 1, __ATOMIC_RELAXED);
+      ++n;
+    }
+  }
+  return n;
+}
+
+/* Writable pages have no translations, so when we run out of room to track
+ * them, we can just protect them all again. */
+int xv_x64_tcache_write_fault(xv_x64_tcache *const tc,
+                              void const    *const addr) {
+  intptr_t const offset = (xv_x64_const_i*) addr - tc->rw.src.logical_start;
+  void const    *const page   = xv_x64_page(addr);
+  unsigned             i      = 0;
+  int status;
+
+  if (offset < 0 || offset >= tc->rw.src.capacity) return 0;
+
+  xv_x64_tcache_invalidate(tc, page, PAGESIZE);
+
+  if (tc->map->nwritable == XV_X64_WRITABLE_PAGES) {
+    for (unsigned j = 0; j < XV_X64_WRITABLE_PAGES; ++j) {
+      xv_x64_mprotect(tc->map->writable[j], PAGESIZE, PROT_READ | PROT_EXEC);
+      tc->map->writable[j] = NULL;
+    }
+    tc->map->nwritable = 0;
+  }
+
+  if (status = xv_x64_mprotect(page, PAGESIZE,
+                               PROT_READ | PROT_WRITE | PROT_EXEC))
+    return status;
+  while (tc->map->writable[i]) ++i;
+  tc->map->writable[i] = page;
+  ++tc->map->nwritable;
+  return 1;
+}
+
+/* Images. */
+/* See "Images" in xv-x64.h. Saving writes the cache's own memory as it is, and */
+/* loading checks everything that the translated code depends on, including */
+/* that every relocated field still fits, before mapping any of it in. */
+
+static inline uint64_t xv_x64_image_code_offset(
+    xv_x64_image const *const image) {
+  return sizeof(xv_x64_image)
+       + image->nblocks * sizeof(xv_x64_block)
+       + image->nrelocs * sizeof(xv_x64_reloc)
+       + PAGESIZE - 1 & ~(PAGESIZE - 1);
+}
+
+static int xv_x64_write_all(int         const fd,
+                            void const *const data,
+                            ssize_t     const size) {
+  for (ssize_t done = 0; done < size;) {
+    ssize_t const n = xv_syscall3(__NR_write, fd,
+                                  (xv_register) ((char const*) data + done),
+                                  size - done);
+    if (n < 0) return n;
+    done += n;
+  }
+  return 0;
+}
+
+int xv_x64_tcache_save(xv_x64_tcache *const tc,
+                       int            const fd,
+                       uint8_t const *const key) {
+  xv_x64_image image = {
+    .magic           = XV_X64_IMAGE_MAGIC,
+    .version         = XV_X64_IMAGE_VERSION,
+    .block_size      = sizeof(xv_x64_block),
+    .src             = (intptr_t) tc->rw.src.logical_start,
+    .src_size        = tc->rw.src.capacity,
+    .dst             = (intptr_t) tc->rw.dst.start,
+    .code_size       = tc->rw.dst.current - tc->rw.dst.start,
+    .nblocks         = tc->nblocks,
+    .block_capacity  = tc->block_capacity,
+    .table_bits      = tc->table_bits,
+    .trace_threshold = tc->trace_threshold,
+    .nrelocs         = tc->nrelocs,
+  };
+  int64_t status;
+
+  memcpy(image.key, key, XV_X64_IMAGE_KEY);
+  if (status = xv_x64_write_all(fd, &image, sizeof(image))) return status;
+  if (status = xv_x64_write_all(fd, tc->blocks,
+                                tc->nblocks * sizeof(xv_x64_block)))
+    return status;
+  if (status = xv_x64_write_all(fd, tc->relocs,
+                                tc->nrelocs * sizeof(xv_x64_reloc)))
+    return status;
+
+  /* The code starts on a page so that loading can map it. */
+  status = xv_syscall3(__NR_lseek, fd, xv_x64_image_code_offset(&image),
+                       SEEK_SET);
+  if (status < 0) return status;
+  return xv_x64_write_all(fd, tc->rw.dst.start, image.code_size);
+}
+
+/* Adjust the fields that relocs describe in code, which has moved by ddst
+ * while the program has moved by dsrc. Returns 0 if any of them wouldn't fit
+ * (or isn't in the code), in which case it leaves code alone when write is 0;
+ * loading checks the file's copy that way first. */
+static int xv_x64_image_relocate(xv_x64_reloc const *const relocs,
+                                 unsigned            const n,
+                                 xv_x64_i           *const code,
+                                 uint64_t            const code_size,
+                                 int64_t             const dsrc,
+                                 int64_t             const ddst,
+                                 int                 const write) {
+  for (unsigned i = 0; i < n; ++i) {
+    xv_x64_reloc const *const r     = &relocs[i];
+    int32_t            *const field = (int32_t*) (code + r->offset);
+    uint64_t            const end   = (uint64_t) r->offset + 4
+                                    + (r->kind == XV_X64_RELOC_ABS64
+                                       ? r->hi : 0);
+
+    if (end > code_size
+        || r->kind == XV_X64_RELOC_ABS64 && r->hi < 4
+        || r->kind > XV_X64_RELOC_ABS64)
+      return 0;
+
+    if (r->kind == XV_X64_RELOC_ABS64) {
+      int32_t *const hi = (int32_t*) ((xv_x64_i*) field + r->hi);
+      uint64_t const a  = (uint64_t) (uint32_t) *hi << 32
+                        | (uint32_t) *field;
+      if (write) {
+        *field = a + dsrc;
+        *hi    = a + dsrc >> 32;
+      }
+      continue;
+    }
+
+    int64_t const v = *field + (r->kind == XV_X64_RELOC_REL32 ? dsrc - ddst
+                                                              : dsrc);
+    if (xv_overflowp(v, 32)) return 0;
+    if (write) *field = v;
+  }
+  return 1;
+}
+
+static inline int xv_x64_image_inp(void const *const p,
+                                   uint64_t    const n,
+                                   uint64_t    const start,
+                                   uint64_t    const end) {
+  uint64_t const a = (uint64_t) p;
+  return a >= start && a <= end && n <= end - a;
+}
+
+/* Everything in the block records that loading writes through or jumps to has
+ * to be inside the image's code (or its code region, for original addresses),
+ * so that a bad file can't point us anywhere else. */
+static int xv_x64_image_blocks_okp(xv_x64_image const *const image) {
+  xv_x64_block const *const blocks  = (xv_x64_block const*) (image + 1);
+  uint64_t            const src     = image->src;
+  uint64_t            const dst     = image->dst;
+  uint64_t            const src_end = src + image->src_size;
+  uint64_t            const dst_end = dst + image->code_size;
+
+  for (unsigned i = 0; i < image->nblocks; ++i) {
+    xv_x64_block const *const block = &blocks[i];
+    if (block->length < 1 || block->length > XV_X64_TRACE_BLOCKS
+        || block->nexits > XV_X64_BLOCK_EXITS
+        || block->code && !xv_x64_image_inp(block->code, 1, dst, dst_end)
+        || !xv_x64_image_inp(block->start, 1, src, src_end)
+        || !xv_x64_image_inp(block->end, 0, src, src_end))
+      return 0;
+
+    for (unsigned j = 0; j < block->nexits; ++j) {
+      xv_x64_exit const *const exit = &block->exits[j];
+      if (exit->kind < XV_X64_EXIT_BRANCH
+          || exit->kind > XV_X64_EXIT_HOT
+          || !xv_x64_image_inp(exit->quads, 16, dst, dst_end)
+          || exit->site
+             && (!xv_x64_image_inp(exit->site, 4, dst, dst_end)
+                 || !xv_x64_image_inp(exit->stub, 1, dst, dst_end)))
+        return 0;
+    }
+  }
+  return 1;
+}
+
+static int xv_x64_image_matchp(xv_x64_tcache const *const tc,
+                               xv_x64_image  const *const image,
+                               ssize_t              const size,
+                               uint8_t       const *const key) {
+  for (unsigned i = 0; i < XV_X64_IMAGE_KEY; ++i)
+    if (image->key[i] != key[i]) return 0;
+
+  return image->magic           == XV_X64_IMAGE_MAGIC
+      && image->version         == XV_X64_IMAGE_VERSION
+      && image->block_size      == sizeof(xv_x64_block)
+      && image->src_size        == tc->rw.src.capacity
+      && image->code_size       <= tc->rw.dst.capacity
+      && image->nblocks         <= tc->block_capacity
+      && image->block_capacity  == tc->block_capacity
+      && image->table_bits      == tc->table_bits
+      && image->trace_threshold == tc->trace_threshold
+      && image->nrelocs         <= tc->reloc_capacity
+      && size == xv_x64_image_code_offset(image) + image->code_size
+      && xv_x64_image_blocks_okp(image)
+      && xv_x64_image_relocate(
+           (xv_x64_reloc const*) ((xv_x64_block const*) (image + 1)
+                                  + image->nblocks),
+           image->nrelocs,
+           (xv_x64_i*) image + xv_x64_image_code_offset(image),
+           image->code_size,
+           (intptr_t) tc->rw.src.logical_start - image->src,
+           (intptr_t) tc->rw.dst.start - image->dst, 0);
+}
+
+int xv_x64_tcache_load(xv_x64_tcache *const tc,
+                       int            const fd,
+                       uint8_t const *const key) {
+  ssize_t const size = xv_syscall3(__NR_lseek, fd, 0, SEEK_END);
+  if (size < 0) return size;
+  if (size < sizeof(xv_x64_image)) return 1;
+
+  void *const file = (void*) xv_syscall6(__NR_mmap, 0, size, PROT_READ,
+                                         MAP_PRIVATE, fd, 0);
+  if (xv_x64_mmap_failedp(file)) return (int) (intptr_t) file;
+
+  xv_x64_image const *const image = file;
+  int const match = xv_x64_image_matchp(tc, image, size, key);
+
+  if (match) {
+    xv_x64_block const *const blocks = (xv_x64_block const*) (image + 1);
+    xv_x64_reloc const *const relocs = (xv_x64_reloc const*)
+                                       (blocks + image->nblocks);
+    uint64_t            const offset = xv_x64_image_code_offset(image);
+    int64_t             const dsrc   = (intptr_t) tc->rw.src.logical_start
+                                     - image->src;
+    int64_t             const ddst   = (intptr_t) tc->rw.dst.start
+                                     - image->dst;
+    xv_x64_tcache_flush(tc);
+
+    /* The arena starts on a page, so the code can replace its first pages
+     * copy-on-write. Copying is the fallback, e.g. on a noexec mount. */
+    void *const code = (void*) xv_syscall6(
+      __NR_mmap, (xv_register) tc->rw.dst.start, image->code_size,
+      PROT_READ | PROT_WRITE | PROT_EXEC, MAP_PRIVATE | MAP_FIXED, fd, offset);
+    if (code != tc->rw.dst.start)
+      memcpy(tc->rw.dst.start, (xv_x64_i const*) file + offset,
+             image->code_size);
+
+    memcpy(tc->blocks, blocks, image->nblocks * sizeof(xv_x64_block));
+    memcpy(tc->relocs, relocs, image->nrelocs * sizeof(xv_x64_reloc));
+    tc->rw.dst.current = tc->rw.dst.start + image->code_size;
+    tc->nblocks        = image->nblocks;
+    tc->nrelocs        = image->nrelocs;
+    xv_x64_image_relocate(tc->relocs, tc->nrelocs, tc->rw.dst.start,
+                          image->code_size, dsrc, ddst, 1);
+
+#define xv_x64_moved(p, d) ((void*) ((char const*) (p) + (d)))
+    for (unsigned i = 0; i < tc->nblocks; ++i) {
+      xv_x64_block *const block = &tc->blocks[i];
+      block->start = xv_x64_moved(block->start, dsrc);
+      block->end   = xv_x64_moved(block->end,   dsrc);
+      if (block->code) block->code = xv_x64_moved(block->code, ddst);
+
+      xv_x64_index_insert(tc, i);
+      if (tc->trace_threshold && block->length == 1)
+        tc->counters[i] = tc->trace_threshold;
+
+      for (unsigned j = 0; j < block->nexits; ++j) {
+        xv_x64_exit *const exit = &block->exits[j];
+        exit->tc    = tc;
+        exit->quads = xv_x64_moved(exit->quads, ddst);
+        if (exit->target) exit->target = xv_x64_moved(exit->target, dsrc);
+        if (exit->site) {
+          exit->site = xv_x64_moved(exit->site, ddst);
+          exit->stub = xv_x64_moved(exit->stub, ddst);
+        }
+        exit->quads[0] = (void const*) xv_x64_exit_receiver;
+        exit->quads[1] = exit;
+      }
+    }
+#undef xv_x64_moved
+
+    xv_x64_tcache_relink(tc);
+  }
+
+  xv_syscall2(__NR_munmap, (xv_register) file, size);
+  return !match;
+}
+
+/* Statistics. */
+/* Each thread counts for itself (see xv_x64_stats in xv-x64.h), so the totals */
+/* are only exact when the group's other threads are stopped or gone. */
+
+void xv_x64_tcache_stats(xv_x64_tcache const *const tc,
+                         xv_x64_stats        *const total) {
+  xv_x64_tcache const *c = tc;
+  memset(total, 0, sizeof(xv_x64_stats));
+  do {
+    xv_x64_stats const *const s = &c->shared->thread.stats;
+    total->blocks           += s->blocks;
+    total->traces           += s->traces;
+    total->hits             += s->hits;
+    total->misses           += s->misses;
+    total->indirect_misses  += s->indirect_misses;
+    total->syscalls         += s->syscalls;
+    total->intercepted      += s->intercepted;
+    total->translate_cycles += s->translate_cycles;
+  } while ((c = c->next) != tc);
+}
+
+/* Thread creation. */
+/* A thread that clone makes starts out with its parent's %gs base, which would */
+/* have two threads sharing one shadow stack and one cache. So instead of running */
+/* the clone inline, the dispatcher picks a cache for the child and resumes at */
+/* xv_x64_clone with the thread's registers. It makes the syscall itself; the */
+/* child then points %gs at its own xv_x64_thread, and the parent waits until the */
+/* child has taken clone_child and clone_resume out of its thread before going */
+/* on, since its next clone would overwrite them. Both sides step over the red */
+/* zone and keep the flags, and the parent marks the child's cache free again if */
+/* the clone failed. */
+
+asm (".text\n"
+     ".globl xv_x64_clone\n"
+     "xv_x64_clone:\n"
+     "  syscall\n"
+     "  mov %rax, %rcx\n"
+     "  jrcxz 3f\n"
+     "  lea -128(%rsp), %rsp\n"
+     "  pushfq\n"
+     "  test %rax, %rax\n"
+     "  js 1f\n"
+     "0:\n"
+     "  pause\n"
+     "  cmpq $0, %gs:32\n"                       /* clone_child */
+     "  jne 0b\n"
+     "  jmp 2f\n"
+     "1:\n"
+     "  mov %gs:32, %rcx\n"
+     "  movl $1, 28(%rcx)\n"                    /* clone_child->exited */
+     "  movq $0, %gs:32\n"
+     "2:\n"
+     "  popfq\n"
+     "  lea 128(%rsp), %rsp\n"
+     "  jmp *%gs:40\n"                           /* clone_resume */
+     "3:\n"
+     "  lea -128(%rsp), %rsp\n"
+     "  push %gs:40\n"
+     "  push %rdi\n"
+     "  push %rsi\n"
+     "  mov %gs:32, %rsi\n"
+     "  movq $0, %gs:32\n"
+     "  mov $0x1001, %edi\n"                     /* ARCH_SET_GS */
+     "  mov $158, %eax\n"                        /* __NR_arch_prctl */
+     "  syscall\n"
+     "  pop %rsi\n"
+     "  pop %rdi\n"
+     "  mov $0, %eax\n"
+     "  ret $128\n");
+
+xv_static_assert(__builtin_offsetof(xv_x64_thread, exited)       == 28)
+xv_static_assert(__builtin_offsetof(xv_x64_thread, clone_child)  == 32)
+xv_static_assert(__builtin_offsetof(xv_x64_thread, clone_resume) == 40)
+xv_static_assert(ARCH_SET_GS == 0x1001 && __NR_arch_prctl == 158)
+
+void xv_x64_clone(void);
+
+/* Flags that make a clone a thread we have to give a cache. */
+#define XV_X64_CLONE_VM    0x100
+#define XV_X64_CLONE_VFORK 0x4000
+
+static inline int xv_x64_clone_threadp(xv_x64_exit_frame const *const frame) {
+  uint64_t const flags =
+#ifdef __NR_clone3
+      frame->rax == __NR_clone3 ? *(uint64_t const*) frame->rdi :
+#endif
+      frame->rax == __NR_clone  ? frame->rdi
+                                : 0;
+  return (flags & (XV_X64_CLONE_VM | XV_X64_CLONE_VFORK)) == XV_X64_CLONE_VM;
+}
+
+/* A new cache gets a smaller arena when there's no room near the region for a
+ * full one, down to this. */
+#define XV_X64_THREAD_MIN_CACHE (1 << 20)
+
+/* A cache in parent's group whose thread has exited, or a new one. */
+static int xv_x64_tcache_spawn(xv_x64_tcache  *const parent,
+                               xv_x64_tcache **const child) {
+  xv_x64_tcache *c = parent;
+  int            status;
+  do {
+    int exited = 1;
+    if (c->spawned
+        && __atomic_compare_exchange_n(&c->shared->thread.exited, &exited, 0,
+                                       0, __ATOMIC_ACQUIRE,
+                                       __ATOMIC_RELAXED)) {
+      for (unsigned i = 0; i < XV_X64_SHADOW_DEPTH; ++i)
+        c->shared->thread.shadow[i].orig = NULL;
+      *child = c;
+      return 0;
+    }
+  } while ((c = __atomic_load_n(&c->next, __ATOMIC_ACQUIRE)) != parent);
+
+  c = xv_x64_mmap(NULL, sizeof(xv_x64_tcache), PROT_READ | PROT_WRITE);
+  if (xv_x64_mmap_failedp(c)) return (int) (intptr_t) c;
+
+  ssize_t  size   = parent->thread_cache_size;
+  unsigned blocks = parent->thread_blocks;
+  while ((status = xv_x64_tcache_setup(c, parent, parent->rw.src.start,
+                                       parent->rw.src.capacity, size, blocks,
+                                       0, 1)) == -ENOMEM
+         && size > XV_X64_THREAD_MIN_CACHE)
+    size >>= 1, blocks = blocks + 1 >> 1;
+  if (status) {
+    xv_syscall2(__NR_munmap, (xv_register) c, sizeof(xv_x64_tcache));
+    return status;
+  }
+  *child = c;
+  return 0;
+}
+
+/* The default for clone and exit (see "Threads" in xv-x64.h). */
+static void const *xv_x64_tcache_threads(xv_x64_exit_frame *const frame,
+                                         xv_x64_const_i    *const native) {
+  xv_x64_thread *const self = xv_x64_thread_current();
+  xv_x64_tcache       *child;
+  int                  status;
+
+  if (frame->rax == __NR_exit) {
+    if (self->tc->spawned)
+      __atomic_store_n(&self->exited, 1, __ATOMIC_RELEASE);
+    return native;
+  }
+  if (!xv_x64_clone_threadp(frame)) return native;
+
+  if (status = xv_x64_tcache_spawn(self->tc, &child)) {
+    frame->rax = status;
+    return native + 2;
+  }
+  self->clone_child  = &child->shared->thread;
+  self->clone_resume = native + 2;
+  return (void const*) xv_x64_clone;
+}
+
+/* Dispatch. */
+/* xv_x64_tcache_enter is also the entry point into translated code from outside */
+/* (e.g. from the test harness). Code that we can't translate traps (see */
+/* xv_x64_untranslatable in xv-x64.h), and nothing links to the trap. That */
+/* includes code outside the cached region, unless the cache has native_escape */
+/* set. Entering sets the %gs base, so each thread has to enter through its own */
+/* cache. */
+
+/* A harness with native_escape calls translated code from C, and translated code */
+/* calls back out to C, so whatever runs natively has to return into translated */
+/* code rather than into the original. When we leave through a call or a jump, */
+/* the program's top of stack is a return address if anything is (a ret has */
+/* already popped its own), so if it points into the region, we swap in its */
+/* translation. */
+
+/* The program's %rsp when it took the exit. */
+static inline void const **xv_x64_exit_rsp(xv_x64_exit_frame *const frame) {
+  return (void const**) ((char*) (frame + 1) + XV_X64_EXIT_STACK - 8);
+}
+
+/* Sets *resume to where orig continues (see xv_x64_tcache_enter), and returns
+ * the status of translating it, if we had to. */
+static int xv_x64_tcache_resolve(xv_x64_tcache *const tc,
+                                 void const    *const orig,
+                                 void const   **const resume) {
+  xv_x64_i *code = xv_x64_tcache_lookup(tc, orig);
+  if (code) {
+    ++tc->shared->thread.stats.hits;
+    *resume = code;
+    return XV_TC_OK;
+  }
+
+  /* Only a cache on its own can make room; in a group, a full cache traps
+   * and xv stops the others first (see "Threads" in xv-x64.h). */
+  ++tc->shared->thread.stats.misses;
+  int status = xv_x64_translate(tc, orig, &code);
+  if (status == XV_TC_FULL && tc->next == tc) {
+    xv_x64_tcache_collect(tc);
+    status = xv_x64_translate(tc, orig, &code);
+  }
+  if (status == XV_TC_FULL && tc->next == tc) {
+    xv_x64_tcache_flush(tc);
+    status = xv_x64_translate(tc, orig, &code);
+  }
+
+  if (!status)
+    *resume = code;
+  else if (status == XV_TC_RANGE && tc->native_escape)
+    *resume = orig;
+  else {
+    xv_x64_trace(0, "xv_x64_tcache_resolve(%p): trap %x\n", orig, status);
+    tc->shared->thread.trap        = orig;
+    tc->shared->thread.trap_status = status;
+    *resume = (void const*) xv_x64_untranslatable;
+  }
+  return status;
+}
+
+void const *xv_x64_tcache_enter(xv_x64_tcache *const tc,
+                                void const    *const orig) {
+  void const *resume;
+  xv_syscall2(__NR_arch_prctl, ARCH_SET_GS,
+              (xv_register) &tc->shared->thread);
+  xv_x64_tcache_resolve(tc, orig, &resume);
+  return resume;
+}
+
+/* The stub sits just before the syscall instruction, so returning to the end
+ * of the stub runs it and returning two bytes later skips it. (syscall,
+ * sysenter, and int $0x80 are all two bytes long.) */
+static void const *xv_x64_tcache_syscall(xv_x64_exit       *const exit,
+                                         xv_x64_exit_frame *const frame) {
+  xv_x64_tcache  *const tc     = exit->tc;
+  xv_x64_const_i *const native = (xv_x64_const_i*) frame->resume + 16;
+  int             const abi    = exit->kind == XV_X64_EXIT_SYSCALL
+                               ? XV_X64_ABI_64 : XV_X64_ABI_32;
+
+  /* tc might be another thread's cache; we count for the one running it. */
+  xv_x64_stats   *const stats  = &xv_x64_thread_current()->stats;
+
+  xv_x64_trace(0, "xv_x64_tcache_syscall(%ld)\n", (long) frame->rax);
+  ++stats->intercepted;
+  stats->syscalls += abi == XV_X64_ABI_32;
+
+  if (!tc->syscall_handler
+      || tc->syscall_handler(tc, frame, abi) == XV_X64_SYSCALL_NATIVE)
+    return abi == XV_X64_ABI_64 ? xv_x64_tcache_threads(frame, native)
+                                : native;
+
+  if (abi == XV_X64_ABI_64) {
+    frame->rcx = (xv_register) exit->target;
+    frame->r11 = frame->rflags;
+  }
+  return native + 2;
+}
+
+void const *xv_x64_tcache_dispatch(xv_x64_exit_frame *const frame) {
+  xv_x64_exit   *const exit    = ((xv_x64_exit *const*) frame->resume)[1];
+  if (exit->kind == XV_X64_EXIT_SYSCALL
+      || exit->kind == XV_X64_EXIT_SYSCALL32)
+    return xv_x64_tcache_syscall(exit, frame);
+  if (exit->kind == XV_X64_EXIT_HOT)
+    return xv_x64_tcache_hot(exit);
+
+  xv_x64_tcache *const tc      = exit->tc;
+  xv_x64_tcache *const self    = xv_x64_thread_current()->tc;
+  unsigned       const resets  = tc->flushes + tc->collections;
+  void const    *const target  = exit->target ? exit->target : frame->target;
+
+  xv_x64_thread_current()->stats.indirect_misses += !exit->target;
+  void const    *resume;
+  int            const status  = xv_x64_tcache_resolve(self, target, &resume);
+
+  xv_x64_trace(0, "xv_x64_tcache_dispatch(%p) -> %p\n", target, resume);
+
+  if (status == XV_TC_RANGE && self->native_escape && !exit->returns) {
+    void const **const top = xv_x64_exit_rsp(frame);
+    void const        *code;
+    intptr_t     const offset = (xv_x64_const_i*) *top
+                              - self->rw.src.logical_start;
+    if (offset >= 0 && offset < self->rw.src.capacity
+        && !xv_x64_tcache_resolve(self, *top, &code))
+      *top = code;
+  }
+
+  /* If the group was reset, the exit we came from is gone. */
+  if (tc->flushes + tc->collections == resets && exit->site && !status)
+    xv_x64_link(exit, (xv_x64_i*) resume);
+
+  return resume;
 }
 
 /* Generated by SDoc */
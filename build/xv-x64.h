@@ -27,6 +27,18 @@ forward_struct(xv_x64_ibuffer)
 forward_struct(xv_x64_const_ibuffer)
 forward_struct(xv_x64_rewriter)
 forward_struct(xv_x64_insn)
+forward_struct(xv_x64_scan_entry)
+forward_struct(xv_x64_tcache)
+forward_struct(xv_x64_tcache_entry)
+forward_struct(xv_x64_tcache_shared)
+forward_struct(xv_x64_tcache_map)
+forward_struct(xv_x64_thread)
+forward_struct(xv_x64_image)
+forward_struct(xv_x64_reloc)
+forward_struct(xv_x64_stats)
+forward_struct(xv_x64_block)
+forward_struct(xv_x64_exit)
+forward_struct(xv_x64_exit_frame)
 
 #undef forward_struct
 
@@ -40,13 +52,14 @@ static inline xv_register xv_syscall6(
     xv_register const arg0, xv_register const arg1, xv_register const arg2,
     xv_register const arg3, xv_register const arg4, xv_register const arg5) {
   xv_register result;
-  asm ("movq %3, %%r10;"
-       "movq %4, %%r8;"
-       "movq %5, %%r9;"
-       "syscall;"
-     : "=a"(result)
-     : "a"(n), "D"(arg0), "S"(arg1), "d"(arg2), "r"(arg3), "r"(arg4), "r"(arg5)
-     : "%r10", "%r8", "%r9", "%rcx", "%r11");
+  asm volatile ("movq %5, %%r10;"
+                "movq %6, %%r8;"
+                "movq %7, %%r9;"
+                "syscall;"
+              : "=a"(result)
+              : "a"(n), "D"(arg0), "S"(arg1), "d"(arg2),
+                "r"(arg3), "r"(arg4), "r"(arg5)
+              : "%r10", "%r8", "%r9", "%rcx", "%r11", "memory");
   return result;
 }
 
@@ -109,6 +122,7 @@ struct xv_x64_ibuffer {
   xv_x64_i       *start;                /* start of allocated region */
   xv_x64_i       *current;              /* current insertion point */
   ssize_t         capacity;             /* size (bytes) of allocated region */
+  int             sizing;               /* count bytes without storing them */
 };
 
 struct xv_x64_const_ibuffer {
@@ -121,7 +135,6 @@ struct xv_x64_const_ibuffer {
 struct xv_x64_rewriter {
   xv_x64_const_ibuffer src;             /* original instructions */
   xv_x64_ibuffer       dst;             /* recompiled instruction stream */
-  void                *xv_entry_point;  /* system call hook address */
 };
 
 /* Free any existing buffer memory, then allocate to new size. buf is unchanged
@@ -179,6 +192,10 @@ int xv_x64_reallocate_ibuffer(xv_x64_ibuffer *buf,
 /*   XV_ADDR_SCALE4        <- *(base + 4*index + displacement) */
 /*   XV_ADDR_SCALE8        <- *(base + 8*index + displacement) */
 
+/* The scaled modes can also omit the base register entirely (SIB base = 101 with */
+/* mod = 0), which is common for things like `lea 0(,%rax,8)`. We indicate this by */
+/* setting insn->nobase; the displacement is then always 32 bits. */
+
 /* Our job, then, is to bidirectionally convert between our sane representation */
 /* and Intel's broken one. The gory details of this are handled in */
 /* `xv_x64_read_insn` and `xv_x64_write_insn`. */
@@ -191,6 +208,7 @@ struct xv_x64_insn {
   unsigned p2     : 3;          /* group-2 instruction prefix */
   unsigned p66    : 1;          /* 0x66 prefix? */
   unsigned p67    : 1;          /* 0x67 prefix? */
+  unsigned rex    : 1;          /* REX prefix present (matters for %sil etc) */
   unsigned rex_w  : 1;          /* presence of REX.W (can exist with VEX) */
   unsigned xop    : 1;          /* encoded with xop? (AMD-specific) */
   unsigned vex    : 1;          /* encoded with vex? (changes semantics) */
@@ -204,6 +222,7 @@ struct xv_x64_insn {
   unsigned base   : 4;          /* secondary operand register or mem offset */
   unsigned index  : 4;          /* indexing register, if used */
   unsigned aux    : 4;          /* third register, only if VEX is used */
+  unsigned nobase : 1;          /* SCALEn with no base register (disp32) */
   int32_t displacement;         /* memory displacement, up to 32 bits */
   int64_t immediate;            /* sometimes memory offset (e.g. JMP) */
 };
@@ -259,7 +278,7 @@ xv_static_assert(!(sizeof(xv_x64_insn) & 0x07))
 #define xv_x64_insn_key(insn_ptr) \
   ({ \
     xv_x64_insn const _insn = *(insn_ptr); \
-    _insn.opcode | _insn.escape << 2; \
+    _insn.opcode | _insn.escape << 8; \
   })
 
 /* Evaluates to nonzero if the instruction's immediate operand is a
@@ -269,16 +288,36 @@ int xv_x64_immrelp(xv_x64_insn const *insn);
 /* Returns nonzero if the instruction is a system call */
 int xv_x64_syscallp(xv_x64_insn const *insn);
 
+/* Returns one of the XV_BRANCH_* values below; nonzero means that the
+ * instruction transfers control somewhere other than the next instruction */
+int xv_x64_branchp(xv_x64_insn const *insn);
+
+#define XV_BRANCH_NONE  0       /* not a control transfer */
+#define XV_BRANCH_JMP   1       /* jmp rel8/rel32 */
+#define XV_BRANCH_JCC   2       /* jcc rel8/rel32 */
+#define XV_BRANCH_LOOP  3       /* loop[n][z], j[er]cxz: rel8 only */
+#define XV_BRANCH_CALL  4       /* call rel32 */
+#define XV_BRANCH_RET   5       /* ret, ret imm16 */
+#define XV_BRANCH_IJMP  6       /* jmp *r/m */
+#define XV_BRANCH_ICALL 7       /* call *r/m */
+#define XV_BRANCH_OTHER 8       /* far transfers, iret, etc (untranslatable) */
+
 /* Write a single instruction into the specified buffer, resizing backing
  * allocation structures as necessary. The buffer's "current" pointer is
  * advanced to the next free position. If errors occur, *buf will be
  * unchanged.
  *
  * If buf == NULL, returns the number of bytes that would be used to write the
- * instruction. */
+ * instruction. If buf->sizing is set, buf is a sizing buffer: nothing gets
+ * stored and there's no capacity limit, but buf->current advances as usual.
+ * Make one by copying the buffer that the code will eventually go into, and
+ * anything that depends on the address (like alignment padding) comes out
+ * the same size it will be for real. */
 int xv_x64_write_insn(xv_x64_ibuffer    *buf,
                       xv_x64_insn const *insn);
 
+#define xv_x64_sizingp(buf) ((buf)->sizing)
+
 #if XV_DEBUG_X64
 /* Print human-readable representation of the instruction to the given buffer.
  * Note that we don't encode the mnemonic of the opcode; we mainly just decode
@@ -322,7 +361,10 @@ int xv_x64_read_insn(xv_x64_const_ibuffer *buf,
 #define XV_READ_INV  12 /* opcode was invalid for x86-64 */
 
 /* Rewrite a single instruction from src to dst, updating either both or
- * neither */
+ * neither. The instruction is relocated so that it behaves identically at its
+ * new address: %rip-relative displacements and relative branch targets still
+ * refer to the original addresses. Short branches are promoted to their rel32
+ * forms when they have one. */
 int xv_x64_step_rw(xv_x64_rewriter *rw);
 
 /* Possible return values for xv_x64_step_rw */
@@ -330,6 +372,32 @@ int xv_x64_step_rw(xv_x64_rewriter *rw);
 #define XV_RW_R 0x100   /* error from read_insn; see low byte for code */
 #define XV_RW_W 0x200   /* error from write_insn; see low byte for code */
 
+/* Build the scanner's tables. Call this before the first xv_x64_scan, and
+ * before starting any threads that might scan; xv_x64_tcache_init calls it. */
+void xv_x64_scan_init(void);
+
+/* Find instruction boundaries without fully decoding each instruction. Writes
+ * up to n entries, one per instruction starting at buf->current, and advances
+ * buf past them. Stops early at the end of the buffer or at the first
+ * instruction that read_insn can't decode, leaving buf->current there. Returns
+ * the number of entries written. */
+unsigned xv_x64_scan(xv_x64_const_ibuffer *buf,
+                     xv_x64_scan_entry    *entries,
+                     unsigned              n);
+
+struct xv_x64_scan_entry {
+  uint32_t offset;              /* from buf->start */
+  uint8_t  length;
+  uint8_t  flags;               /* XV_SCAN_* */
+};
+
+/* Flags for xv_x64_scan_entry; an instruction with none of them set doesn't
+ * care where it lives, so it can be copied byte-for-byte. */
+#define XV_SCAN_COPY    0x00
+#define XV_SCAN_BRANCH  0x01    /* control transfer or relative immediate */
+#define XV_SCAN_RIPREL  0x02    /* %rip-relative memory operand */
+#define XV_SCAN_SYSCALL 0x04    /* possibly a system call (int $n included) */
+
 /* Operand encodings. */
 /* These are used for two purposes. First, we need them to indicate the length of */
 /* the remainder of the instruction; and second, we need to figure out how memory */
@@ -357,14 +425,467 @@ typedef uint8_t xv_x64_insn_encoding;
 #define XV_IMM_I32  (6 << 1)    /* 32-bit invariant immediate */
 #define XV_IMM_I64  (7 << 1)    /* 64-bit invariant immediate */
 #define XV_IMM_ISZW (8 << 1)    /* word for 16-bit opsize, dword for larger */
-#define XV_IMM_ISZQ (9 << 1)    /* word, dword, or qword based on 66 and 67 */
+#define XV_IMM_ISZQ (9 << 1)    /* word, dword, or qword based on 66 and W */
 #define XV_IMM_I2   (10 << 1)   /* imm16, imm8 (e.g. ENTER) */
+#define XV_IMM_A64  (11 << 1)   /* qword address, dword with 67 (moffs) */
 
 /* Special value: invalid instruction */
 #define XV_INVALID_MASK 0x80
 #define XV_INVALID      0x80
 
-xv_x64_insn_encoding const xv_x64_insn_encodings[1024];
+extern xv_x64_insn_encoding const xv_x64_insn_encodings[1024];
+
+/* Translation cache. */
+/* Rather than rewriting code in one pass, we translate it a basic block at a time */
+/* as it's reached. A block runs up to and including the first control transfer, */
+/* and each translated block is stored in a cache keyed by its original address. */
+/* The exits of a block are initially routed through small stubs that call back */
+/* into xv, which finds (or makes) the target block and returns to it. */
+
+/* This round-trip is expensive, so once both ends of a direct jmp, jcc, or call */
+/* are translated, we patch the exit's rel32 to jump straight to the target */
+/* block. After that, hot loops run entirely inside the cache. */
+
+/* Indirect transfers (ret, jmp *, call *) can't be patched this way, since the */
+/* program keeps using original code addresses for everything, including return */
+/* addresses. Instead, the translated code probes the cache's hash table inline */
+/* and only calls back into xv on a miss. Returns check a shadow stack first: */
+/* each translated call records its original return address alongside the */
+/* translated code that continues after it, and a ret whose target matches the */
+/* top entry goes straight there. The shadow stack is only a prediction, so a */
+/* mismatch (longjmp, a rewritten return address, or the ring wrapping around) */
+/* just falls back to the hash probe. */
+
+/* Blocks can also count how often they run, if tc->trace_threshold is set. Once */
+/* a block has run that many times, we follow its most frequently run successors */
+/* through jumps, conditional branches, and fall-throughs, and translate the whole */
+/* path as a single trace. A trace lays its blocks out one after another: jumps */
+/* between them disappear, and each conditional branch becomes a side exit, */
+/* inverted if necessary so that the hot path falls through. Traces don't count */
+/* anything, and the block that started one is patched to jump to it. */
+
+/* Threads. */
+/* Each thread gets its own cache, which means its own blocks, counters, and */
+/* arena; that way threads translate in parallel without any locks. The caches */
+/* in a group share one original -> translated table, so a block translated by */
+/* one thread is immediately used by the others, either through the inline probe */
+/* or by linking to it. Slots are published with cmpxchg16b, so readers never */
+/* see an address without its translation, and links are rel32 fields aligned */
+/* to four bytes, so patching them is a single atomic store. */
+
+/* This means a thread can run code from another thread's cache. Anything in */
+/* translated code that's per-thread (which is just the shadow stack) is */
+/* addressed through %gs, whose base xv_x64_tcache_enter points at the cache's */
+/* xv_x64_thread; and the dispatcher translates into the running thread's cache, */
+/* not the cache that the exit belongs to. The program therefore can't use %gs, */
+/* which Linux programs don't; translation stops at any instruction with a %gs */
+/* prefix, and one that starts a block traps with `XV_TC_SEGMENT`. */
+
+/* New threads get their caches by default. xv_x64_tcache_init intercepts clone, */
+/* clone3, and exit, and a clone that shares the address space without */
+/* suspending the parent (a pthread, not a vfork) gets a cache in the group for */
+/* its child: one whose thread has exited, or else a new one with */
+/* thread_cache_size bytes and thread_blocks blocks. Those start out the same as */
+/* the first cache's, and get halved (down to 1MB) when there's no room for the */
+/* arena near the region. The child points %gs at it before it runs any */
+/* translated code. A syscall handler can still take these syscalls over by */
+/* answering them itself. A clone only fails if the kernel won't give us memory */
+/* at all; running out of room in the group's table doesn't stop it. */
+
+/* A thread only builds traces from its own blocks, so a trace and the block it */
+/* replaces always share a cache. Whole-group operations (flush, collect, */
+/* invalidate, write faults, and freeing a cache) are only safe while the other */
+/* threads are stopped; xv has to arrange that. So a cache that fills up while */
+/* it has company can't make room by itself: it traps like untranslatable code */
+/* does, with `XV_TC_FULL` in the thread's trap_status, and xv stops the group, */
+/* collects or flushes it, and enters again at the trap address. The group's */
+/* table is sized when its first cache is made, for max_caches caches, so that it */
+/* never fills up before the caches do. Clones can take the group past that, in */
+/* which case the table fills up first and the group just makes room more often. */
+
+/* Exit stubs use a register-preserving protocol rather than a C call. Each stub */
+/* moves %rsp below the red zone, leaving one slot for an indirect target, and */
+/* then does `call *0(%rip)` with two quadwords after it: the address of */
+/* `xv_x64_exit_receiver` and the address of the exit record. The receiver saves */
+/* the program's registers into an `xv_x64_exit_frame`, calls */
+/* `xv_x64_tcache_dispatch`, and resumes at the address that returns using `ret */
+/* $136`, which restores %rsp exactly. */
+
+struct xv_x64_exit {
+  xv_x64_tcache *tc;            /* cache that owns the block */
+  void const    *target;        /* original target address; NULL if indirect */
+  int32_t       *site;          /* rel32 to patch when linking, NULL if none */
+  xv_x64_i      *stub;          /* where site points when it isn't linked */
+  void const   **quads;         /* receiver and exit quadwords of its call */
+  int            kind;          /* XV_X64_EXIT_* */
+  int            returns;       /* a ret's, so no return address is left */
+};
+
+#define XV_X64_EXIT_BRANCH  0   /* leaving the block */
+#define XV_X64_EXIT_SYSCALL 1   /* intercepted syscall; target is its return */
+#define XV_X64_EXIT_SYSCALL32 2 /* int $0x80 or sysenter, always intercepted */
+#define XV_X64_EXIT_HOT     3   /* counter ran out; target is the block start */
+
+/* A basic block has at most three exits: hot, taken, and fall-through. A
+ * trace has a side exit for each block but the last, which keeps its own. */
+#define XV_X64_TRACE_BLOCKS 4
+#define XV_X64_BLOCK_EXITS  (XV_X64_TRACE_BLOCKS + 1)
+
+struct xv_x64_block {
+  void const *start;            /* original address of first instruction */
+  void const *end;              /* original address just past the last block */
+  xv_x64_i   *code;             /* translated entry point; NULL if invalidated */
+  unsigned    length;           /* 1, or the number of blocks in a trace */
+  int         branch;           /* XV_BRANCH_* ending it, or XV_X64_END_SYSCALL */
+  unsigned    nexits;
+  xv_x64_exit exits[XV_X64_BLOCK_EXITS];
+};
+
+#define XV_X64_END_SYSCALL 16    /* block->branch for a block ending in syscall */
+
+struct xv_x64_tcache_entry {
+  void const *orig;             /* original address; NULL if slot is free */
+  xv_x64_i   *code;             /* translated entry point */
+};
+
+/* Counters for xv_virt_dump_stats. Each thread counts into its own
+ * xv_x64_thread: blocks from any cache can run on any thread, so a counter per
+ * cache would have threads racing on its read-modify-write. Translated code
+ * bumps stats.syscalls itself, through %gs. */
+struct xv_x64_stats {
+  uint64_t blocks;              /* basic blocks and traces translated */
+  uint64_t traces;
+  uint64_t hits;                /* dispatches that found a translation */
+  uint64_t misses;              /* dispatches that had to translate */
+  uint64_t indirect_misses;     /* inline probes that went to the dispatcher */
+  uint64_t syscalls;            /* translated syscalls, however they ran */
+  uint64_t intercepted;         /* syscalls that went to the handler */
+  uint64_t translate_cycles;    /* rdtsc cycles spent translating */
+};
+
+/* One per thread, at %gs:0 while translated code runs (see "Threads"). The
+ * shadow stack is a ring indexed by a byte, which lets generated code wrap it
+ * with incb/decb. */
+#define XV_X64_SHADOW_DEPTH 256
+
+struct xv_x64_thread {
+  xv_x64_thread       *self;    /* so C code can find it */
+  xv_x64_tcache       *tc;      /* where this thread translates */
+  void const          *trap;    /* last address we couldn't translate */
+  int                  trap_status; /* and why: XV_TC_* or XV_RW_* */
+  int                  exited;  /* a spawned thread is gone; cache is free */
+  xv_x64_thread       *clone_child;  /* thread of a clone in progress */
+  void const          *clone_resume; /* where both sides of it continue */
+  xv_x64_stats         stats;
+  uint8_t              shadow_top;
+  xv_x64_tcache_entry  shadow[XV_X64_SHADOW_DEPTH];
+};
+
+/* Translated code reads this directly (%rip-relative), so it lives just below
+ * the translated code. The syscall policy table is indexed by %ax, since
+ * there's no way to bounds-check %rax without touching the flags. */
+#define XV_X64_SYSCALLS 65536
+
+struct xv_x64_tcache_shared {
+  xv_x64_tcache_entry *table;   /* == tc->table */
+  xv_x64_thread        thread;  /* the thread that owns this cache */
+  uint8_t              syscall_policy[XV_X64_SYSCALLS];
+};
+
+/* Code pages we've made writable after a write fault; see "Eviction". */
+#define XV_X64_WRITABLE_PAGES 16
+
+/* The original -> translated table, shared by all of the caches in a group.
+ * Entries are 16-byte aligned so they can be published with cmpxchg16b. */
+struct xv_x64_tcache_map {
+  unsigned             count;   /* slots in use; updated atomically */
+  unsigned             caches;  /* caches in the group */
+  unsigned             nwritable;
+  unsigned             reserved; /* blocks the caches can hold, all told */
+  void const          *writable[XV_X64_WRITABLE_PAGES]; /* NULL if free */
+  xv_x64_tcache_entry  entries[];
+};
+
+xv_static_assert(!(sizeof(xv_x64_tcache_map) & 15))
+
+/* Returns XV_X64_SYSCALL_NATIVE or XV_X64_SYSCALL_DONE. abi says which
+ * syscall numbers and argument registers the program is using. */
+typedef int (*xv_x64_syscall_handler)(xv_x64_tcache     *tc,
+                                      xv_x64_exit_frame *frame,
+                                      int                abi);
+
+#define XV_X64_SYSCALL_NATIVE 0 /* run it inline with the frame's registers */
+#define XV_X64_SYSCALL_DONE   1 /* frame->rax has the result; skip it */
+
+#define XV_X64_ABI_64 0         /* syscall: x86-64 numbers and registers */
+#define XV_X64_ABI_32 1         /* int $0x80, sysenter: i386 numbers, %ebx... */
+
+struct xv_x64_tcache {
+  xv_x64_rewriter        rw;      /* src = program code, dst = translated code */
+  xv_x64_tcache_shared  *shared;  /* just below dst, in the same mapping */
+  uint32_t              *counters; /* between shared and dst, one per block */
+  xv_x64_block          *blocks;  /* translated blocks, in translation order */
+  unsigned               nblocks;
+  unsigned               block_capacity;
+  uint32_t              *index;   /* 1 + block for an original address */
+  unsigned               index_bits;
+  xv_x64_reloc          *relocs;  /* for images; see "Images" below */
+  unsigned               nrelocs;
+  unsigned               reloc_capacity;
+  xv_x64_tcache_map     *map;     /* shared with the rest of the group */
+  xv_x64_tcache_entry   *table;   /* == map->entries, linear probing */
+  unsigned               table_bits;
+  xv_x64_tcache         *next;    /* ring of caches sharing map */
+  unsigned               flushes; /* incremented each time the cache is reset */
+  unsigned               collections;
+  xv_x64_syscall_handler syscall_handler; /* NULL runs everything inline */
+  uint32_t               trace_threshold; /* 0 = no counters or traces */
+  ssize_t                thread_cache_size; /* for clones; see "Threads" */
+  unsigned               thread_blocks;
+  int                    spawned; /* made for a clone; see "Threads" */
+  int                    native_escape; /* tests only; see tcache_enter */
+};
+
+/* Registers as the receiver saves them; this is the stack layout, so don't
+ * reorder anything. resume initially points to the receiver-address quadword
+ * in the exit stub; target is only meaningful for indirect exits. */
+struct xv_x64_exit_frame {
+  xv_register r15, r14, r13, r12, r11, r10, r9, r8;
+  xv_register rdi, rsi, rbp, rbx, rdx, rcx, rax;
+  xv_register rflags;
+  void const *resume;
+  void const *target;
+};
+
+xv_static_assert(sizeof(xv_x64_exit_frame) == 18 * 8)
+
+/* Bytes below the program's %rsp that an exit stub claims: the red zone plus
+ * one slot for an indirect branch target. */
+#define XV_X64_EXIT_STACK 136
+
+/* Upper bound on instructions per block, so that translation latency is
+ * bounded for long straight-line code. */
+#define XV_X64_BLOCK_INSNS 256
+
+#define xv_x64_tcache_hash(tc, addr) \
+  ((uint32_t) (uintptr_t) (addr) * 0x9e3779b1u >> 32 - (tc)->table_bits)
+
+/* Set up a cache for the code region [code, code + size), which lives at its
+ * original address. cache_size is the number of bytes of translated code, and
+ * max_blocks bounds the number of blocks. The group's table has room for
+ * max_caches caches of that size. Returns 0 or -errno. */
+int xv_x64_tcache_init(xv_x64_tcache  *tc,
+                       xv_x64_const_i *code,
+                       ssize_t         size,
+                       ssize_t         cache_size,
+                       unsigned        max_blocks,
+                       unsigned        max_caches);
+
+/* Make tc a cache for another thread in parent's group, with parent's code
+ * region, syscall settings, and trace threshold. Returns 0 or -errno; -ENOSPC
+ * if the group's table doesn't have room for max_blocks more blocks. (Caches
+ * for clones don't go through here, and can't fail that way.) */
+int xv_x64_tcache_init_thread(xv_x64_tcache *tc,
+                              xv_x64_tcache *parent,
+                              ssize_t        cache_size,
+                              unsigned       max_blocks);
+
+/* Release all memory held by the cache. Returns 0 or -errno. */
+int xv_x64_tcache_free(xv_x64_tcache *tc);
+
+/* Discard all translations in tc's group. Nothing outside the cache refers to
+ * translated code (the program only sees original addresses), so this is
+ * safe from within xv, as long as the group's other threads are stopped. */
+void xv_x64_tcache_flush(xv_x64_tcache *tc);
+
+/* Make room by keeping only the blocks that have been running lately (see
+ * "Eviction" below). Like flush, this is only safe from within xv. */
+void xv_x64_tcache_collect(xv_x64_tcache *tc);
+
+/* Drop every translation of code in [start, start + size). This doesn't touch
+ * the translated code, so it's safe even if that code is running. */
+void xv_x64_tcache_invalidate(xv_x64_tcache *tc,
+                              void const    *start,
+                              ssize_t        size);
+
+/* Write-protect the cached region. Returns 0 or -errno. */
+int xv_x64_tcache_protect(xv_x64_tcache *tc);
+
+/* Handle a write fault at addr. Returns 1 if addr was in the cached region,
+ * whose translations are now gone and whose page is now writable; 0 if it
+ * wasn't ours; or -errno. */
+int xv_x64_tcache_write_fault(xv_x64_tcache *tc,
+                              void const    *addr);
+
+/* Returns the translated entry point for orig, or NULL if it isn't cached. */
+xv_x64_i *xv_x64_tcache_lookup(xv_x64_tcache const *tc,
+                               void const          *orig);
+
+/* Translate the block starting at orig, writing its entry point into *code. */
+int xv_x64_translate(xv_x64_tcache *tc,
+                     void const    *orig,
+                     xv_x64_i     **code);
+
+/* Possible return values for xv_x64_translate (also any XV_RW_* code) */
+#define XV_TC_OK    0   /* no problems */
+#define XV_TC_FULL  1   /* out of cache or block space; flush and retry */
+#define XV_TC_RANGE 2   /* address is outside the cached code region */
+#define XV_TC_BRANCH 3  /* untranslatable control transfer (far jmp, etc) */
+#define XV_TC_SEGMENT 4 /* uses %gs, which belongs to xv */
+
+/* Eviction. */
+/* The cache has a fixed size, so eventually it fills up. Rather than throwing */
+/* everything away, we copy the blocks that are still in use: that is, we */
+/* translate them again at the start of the cache (translated code isn't */
+/* position-independent, so a memcpy won't do). A block is in use if its counter */
+/* says it has run since it was last translated, which also means that this */
+/* needs tc->trace_threshold. Without counters, collect is the same as flush. We */
+/* keep at most half the blocks, the hottest ones, so that collecting always */
+/* frees a good amount of space. */
+
+/* Original code can change, too. The region is write-protected, and a write */
+/* fault invalidates every translation of the page it hits, then makes the page */
+/* writable so the write can go through. The next translation from that page */
+/* protects it again. Invalidated blocks stay where they are until the next */
+/* collection; we just unlink them, so a block that is still running finishes */
+/* normally and leaves through its exit stubs. (A write into a page without */
+/* translations costs one fault and no invalidation.) */
+
+/* Images. */
+/* Translation is most of the cost of starting up, and short-lived processes pay */
+/* it every time for the same code. So a cache can be saved to an image file and */
+/* loaded into a later process's cache, which costs a copy and a relink instead */
+/* of decoding and encoding every block again. */
+
+/* Translated code is full of addresses. References to the shared page and */
+/* counters, and jumps within the arena, move with the cache and don't need */
+/* anything. References to the program don't: %rip-relative operands and */
+/* relative branches that reach the program's code or data, and original return */
+/* addresses pushed as immediates. The cache records each of those as an */
+/* xv_x64_reloc as it translates, and loading adds the distance that the program */
+/* (src) and the arena (dst) have moved since the image was saved. So a PIE */
+/* binary can load at a different address, and the arena can land anywhere */
+/* within reach of it. An image still has to match the cache's layout: the same */
+/* block capacity, table size, and trace threshold, and a region of the same */
+/* size. xv's own memory moves too, so each exit's owner and the two quadwords */
+/* of its receiver call get fixed up from the block records, and the links */
+/* between blocks are rebuilt the same way a collection rebuilds them. */
+
+/* The caller picks the key that an image has to match byte for byte; xv-virt.h */
+/* uses the ELF build-id of the file that the code came from, its mtime, and its */
+/* size. An image file is an xv_x64_image header, then the block records as */
+/* xv_x64_block structures (with pointers into the cache as they were), then the */
+/* relocations, then the translated code, starting on a page boundary. The code */
+/* gets mapped from the file copy-on-write rather than read, so pages that no */
+/* relocation or exit touches stay shared with the page cache. */
+
+#define XV_X64_IMAGE_MAGIC   0x6567616d692d7678ull   /* "xv-image" */
+#define XV_X64_IMAGE_VERSION 2
+#define XV_X64_IMAGE_KEY     64
+
+struct xv_x64_image {
+  uint64_t magic;
+  uint32_t version;
+  uint32_t block_size;          /* sizeof(xv_x64_block) */
+  uint8_t  key[XV_X64_IMAGE_KEY];
+  uint64_t src;                 /* tc->rw.src.logical_start */
+  uint64_t src_size;
+  uint64_t dst;                 /* tc->rw.dst.start */
+  uint64_t code_size;           /* bytes of translated code */
+  uint32_t nblocks;
+  uint32_t block_capacity;
+  uint32_t table_bits;
+  uint32_t trace_threshold;
+  uint32_t nrelocs;
+  uint32_t padding;
+};
+
+/* A field in translated code that depends on where the program is. offset is
+ * from the start of the arena; hi is only for XV_X64_RELOC_ABS64. */
+struct xv_x64_reloc {
+  uint32_t offset;
+  uint16_t kind;                /* XV_X64_RELOC_* */
+  uint16_t hi;                  /* from offset to the high half */
+};
+
+#define XV_X64_RELOC_REL32 0    /* rel32 or disp32 to the program */
+#define XV_X64_RELOC_ABS32 1    /* program address as a sign-extended imm32 */
+#define XV_X64_RELOC_ABS64 2    /* program address as two imm32 halves */
+
+/* Write tc's translations to fd under key. Returns 0 or -errno. fd should be
+ * a new file, not a loaded image; see xv_virt_save in xv-virt.h. */
+int xv_x64_tcache_save(xv_x64_tcache *tc,
+                       int            fd,
+                       uint8_t const *key);
+
+/* Flush tc's group and load the image in fd instead, if it has the same key
+ * and fits this cache (see above), and every block record stays inside the
+ * image. Returns 0 if it loaded, 1 if it didn't match (and tc is unchanged),
+ * or -errno. */
+int xv_x64_tcache_load(xv_x64_tcache *tc,
+                       int            fd,
+                       uint8_t const *key);
+
+/* Syscalls. */
+/* Translated `syscall` instructions look up %ax in the cache's policy table. */
+/* Syscalls that xv doesn't need to see run inline, right there in the translated */
+/* code, and cost seven extra instructions (three of which count it). The rest */
+/* go through the exit receiver to tc->syscall_handler, which sees all of the */
+/* program's registers. */
+/* The handler can either let the syscall run inline afterwards (possibly with */
+/* different arguments), or do it itself and put the result into frame->rax. */
+
+/* Running inline is the only option for clone, since the child would otherwise */
+/* come back to life inside xv's C stack frames. That's also why intercepting a */
+/* syscall doesn't mean emulating it. */
+
+/* The inline path leaves a translated address in %rcx, which the kernel sets to */
+/* the return address. Nothing reads that (the ABI says %rcx is clobbered), and */
+/* the handled path sets %rcx and %r11 as the kernel would. */
+
+/* The other two syscall instructions, `int $0x80` and `sysenter`, make i386 */
+/* syscalls even from 64-bit code, so a program could use them to map memory */
+/* behind our backs. Their numbers don't match the policy table and they don't */
+/* clobber %rcx, so they always go to the handler, with abi set to */
+/* XV_X64_ABI_32. They're rare enough that the extra trip doesn't matter. */
+
+/* Send syscall nr to tc->syscall_handler (intercept != 0) or run it inline
+ * (intercept == 0). New caches intercept the ones that change the address
+ * space, signal handlers, or threads: mmap, mprotect, munmap, mremap,
+ * rt_sigaction, clone, clone3, and exit. */
+void xv_x64_tcache_intercept(xv_x64_tcache *tc,
+                             unsigned       nr,
+                             int            intercept);
+
+/* Add up the counters of every thread in tc's group. */
+void xv_x64_tcache_stats(xv_x64_tcache const *tc,
+                         xv_x64_stats        *total);
+
+/* Point a direct exit at translated code. */
+void xv_x64_link(xv_x64_exit *exit,
+                 xv_x64_i    *code);
+
+/* Lookup-or-translate, flushing the cache if it's full. Returns the address
+ * at which to continue executing orig: translated code if we can, and
+ * otherwise xv_x64_untranslatable. That includes addresses outside the cached
+ * region, with one exception for test harnesses, which call translated code
+ * from C and need it to return: if tc->native_escape is set, code outside the
+ * region runs natively, and calls out return into translated code. xv never
+ * sets it, since the program would be out from under it. */
+void const *xv_x64_tcache_enter(xv_x64_tcache *tc,
+                                void const    *orig);
+
+/* Called by xv_x64_exit_receiver; returns the address to resume at. */
+void const *xv_x64_tcache_dispatch(xv_x64_exit_frame *frame);
+
+/* Assembly entry point for exit stubs; see above. Not callable from C. */
+void xv_x64_exit_receiver(void);
+
+/* Where a thread resumes when the code it has to run next can't be
+ * translated. Running it natively would let the program out from under xv,
+ * so this is a ud2 instead: the program gets SIGILL with its registers as
+ * they were, and the thread's trap and trap_status say where and why. */
+void xv_x64_untranslatable(void);
 
 #endif
 
@@ -37,6 +37,12 @@ static inline void *memcpy(void *const dst, void const *const src,
   for (int i = 0; i < n; ++i) dst_bytes[i] = src_bytes[i];
   return dst;
 }
+
+static inline void *memset(void *const dst, int const c, ssize_t const n) {
+  uint8_t *const dst_bytes = (uint8_t*) dst;
+  for (int i = 0; i < n; ++i) dst_bytes[i] = c;
+  return dst;
+}
 #endif
 
 /* Debugging stuff. */
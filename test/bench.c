@@ -0,0 +1,415 @@
+#include "../build/xv.h"
+#include "../build/xv-x64.h"
+
+#include <elf.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Measures the decoder, the encoder, and the rewriter over the .text section
+ * of each ELF file on the command line, and checks that every re-encoded or
+ * rewritten instruction decodes back to the original. Bytes that don't decode
+ * are skipped one at a time, which is also what happens to padding between
+ * functions. Any instruction that comes back different fails the run, and so
+ * does a re-encoding that isn't byte-exact for some reason other than the
+ * ones in encoding_kinds. */
+
+#define ROUNDS 5
+
+static double now(void) {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+static void report(char const *const name,
+                   unsigned long const n,
+                   double        const seconds) {
+  printf("  %-8s %9lu insns %9.2f ms %8.2f M insns/s\n",
+         name, n, seconds * 1e3, n / seconds * 1e-6);
+}
+
+/* Two decodings agree if every field other than the addresses matches, once
+ * relative operands are compared by target and short branches by their rel32
+ * forms. The relocator promotes those, and the encoder drops REX bits and SIB
+ * indexes that select nothing (and REX before VEX) and picks its own ModR/M and
+ * displacement sizes, which don't show up in the fields at all. */
+static void canonicalize(xv_x64_insn *const insn) {
+  if (!(insn->addr & XV_ADDR_SCALE_BIT)) insn->index  = 0;
+  if (insn->nobase)                      insn->base  &= 7;
+  if (insn->vex || insn->xop)            insn->rex    = 0;
+  if (xv_x64_immrelp(insn)) {
+    insn->immediate += (intptr_t) insn->rip;
+    if (insn->escape == XV_INSN_ESC0 && (insn->opcode & 0xf0) == 0x70)
+      insn->escape = XV_INSN_ESC1, insn->opcode += 0x10;
+    else if (insn->escape == XV_INSN_ESC0 && insn->opcode == 0xeb)
+      insn->opcode = 0xe9;
+  }
+}
+
+static int short_branchp(xv_x64_insn const *const insn) {
+  return xv_x64_immrelp(insn) && insn->escape == XV_INSN_ESC0
+      && ((insn->opcode & 0xf0) == 0x70 || insn->opcode == 0xeb);
+}
+
+static int same_insn(xv_x64_insn a, xv_x64_insn b) {
+  canonicalize(&a);
+  canonicalize(&b);
+  return a.p1     == b.p1     && a.p2     == b.p2    && a.p66   == b.p66
+      && a.p67    == b.p67    && a.rex    == b.rex   && a.rex_w == b.rex_w
+      && a.xop    == b.xop    && a.vex    == b.vex   && a.vex_l == b.vex_l
+      && a.escape == b.escape && a.opcode == b.opcode
+      && a.addr   == b.addr   && a.reg    == b.reg   && a.base  == b.base
+      && a.index  == b.index  && a.aux    == b.aux   && a.nobase == b.nobase
+      && a.immediate == b.immediate
+      && (a.addr == XV_ADDR_RIPREL
+            ? (intptr_t) a.rip + a.displacement
+              == (intptr_t) b.rip + b.displacement
+            : a.displacement == b.displacement);
+}
+
+/* Decodes the encoding of `original` (whose bytes are at `source`) in
+ * [code, end), which lives at `logical`, and counts a mismatch unless it's the
+ * whole of one equivalent instruction. */
+static int check_insn(char          const *const what,
+                      xv_x64_insn   const *const original,
+                      xv_x64_const_i      *const source,
+                      xv_x64_const_i      *const logical,
+                      xv_x64_const_i      *const code,
+                      xv_x64_const_i      *const end,
+                      unsigned long       *const mismatches) {
+  xv_x64_const_ibuffer buf = { logical, code, code, end - code };
+  xv_x64_insn          insn;
+  if (!xv_x64_read_insn(&buf, &insn) && buf.current == end
+      && same_insn(*original, insn))
+    return 0;
+
+  if (++*mismatches <= 5) {
+    printf("  %s mismatch:", what);
+    for (xv_x64_const_i *c = source;
+         c < source + ((xv_x64_const_i*) original->rip
+                       - (xv_x64_const_i*) original->start); ++c)
+      printf(" %02x", *c);
+    printf(" ->");
+    for (xv_x64_const_i *c = code; c < end; ++c) printf(" %02x", *c);
+    printf("\n");
+  }
+  return 1;
+}
+
+/* Ways that the encoder's choices differ from another assembler's (or from
+ * bytes that were never code, since the sweep can wander into data). */
+enum { ENC_PREFIX, ENC_REX, ENC_SIB, ENC_DISP, ENC_VEX_MAP, ENC_OTHER,
+       ENC_KINDS };
+
+static char const *const encoding_kinds[ENC_KINDS] = {
+  "prefixes reordered, repeated, or superseded",
+  "REX bits that select nothing",
+  "SIB bytes that select nothing",
+  "disp8 vs disp32",
+  "VEX maps that don't exist, which the decoder folds",
+  "anything else",
+};
+
+/* Legacy prefixes by group; the encoder writes at most one from each. */
+static xv_x64_const_i const prefixes[] = {
+  0xf0, 0xf2, 0xf3,                     /* 0-2: lock, rep */
+  0x2e, 0x36, 0x3e, 0x26, 0x64, 0x65,   /* 3-8: segments */
+  0x66,                                 /* 9 */
+  0x67,                                 /* 10 */
+};
+static unsigned const prefix_groups[] = { 0x7, 0x1f8, 0x200, 0x400 };
+
+/* The legacy prefixes at the start of [*p, end), as a bit per prefix byte;
+ * *p ends up after them. */
+static unsigned take_prefixes(xv_x64_const_i **const p,
+                              xv_x64_const_i  *const end) {
+  unsigned set = 0;
+  for (; *p < end; ++*p) {
+    unsigned i = 0;
+    while (i < sizeof(prefixes) && **p != prefixes[i]) ++i;
+    if (i == sizeof(prefixes)) break;
+    set |= 1 << i;
+  }
+  return set;
+}
+
+static xv_x64_const_i *skip_opcode(xv_x64_insn   const *const insn,
+                                   xv_x64_const_i      *const p) {
+  if (insn->vex || insn->xop) return p + (*p == 0xc5 ? 2 : 3) + 1;
+  return p + (insn->escape == XV_INSN_ESC0 ? 1
+            : insn->escape == XV_INSN_ESC1 ? 2 : 3);
+}
+
+static unsigned disp_size(xv_x64_const_i const modrm,
+                          xv_x64_const_i const sib) {
+  unsigned const mod = modrm >> 6, rm = modrm & 7;
+  return mod == 1 ? 1
+       : mod == 2 || !mod && (rm == 5 || rm == 4 && (sib & 7) == 5) ? 4
+       : 0;
+}
+
+/* Which ENC_ kinds explain how the encoding [e, e_end) differs from the
+ * original bytes of insn; ENC_OTHER if they don't explain all of it. The two
+ * already decode the same, so only the parts that the fields don't pin down
+ * can differ. */
+static unsigned encoding_differences(xv_x64_insn   const *const insn,
+                                     xv_x64_const_i      *const e_start,
+                                     xv_x64_const_i      *const e_end) {
+  ssize_t const  length = (xv_x64_const_i*) insn->rip
+                        - (xv_x64_const_i*) insn->start;
+  xv_x64_i       copy[16];
+  xv_x64_const_i *o     = copy, *const o_end = copy + length;
+  xv_x64_const_i *e     = e_start;
+  unsigned       kinds  = 0;
+  __builtin_memcpy(copy, insn->start, length);
+
+  unsigned const o_set = take_prefixes(&o, o_end);
+  unsigned const e_set = take_prefixes(&e, e_end);
+  if (o - copy != e - e_start || __builtin_memcmp(copy, e_start, o - copy)) {
+    for (unsigned g = 0; g < sizeof(prefix_groups) / sizeof(*prefix_groups);
+         ++g)
+      if (!(o_set & prefix_groups[g]) != !(e_set & prefix_groups[g]))
+        return 1 << ENC_OTHER;
+    if (e_set & ~o_set) return 1 << ENC_OTHER;
+    kinds |= 1 << ENC_PREFIX;
+  }
+
+  /* A REX before another one is a repeat. VEX and XOP carry their own
+   * (inverted) REX.X. */
+  unsigned o_rex = 0, e_rex = 0;
+  if (o < o_end && (*o & 0xf0) == 0x40) o_rex = *o++;
+  if (o < o_end && (*o & 0xf0) == 0x40) {
+    while (o < o_end && (*o & 0xf0) == 0x40) o_rex = *o++;
+    kinds |= 1 << ENC_PREFIX;
+  }
+  if (e < e_end && (*e & 0xf0) == 0x40) e_rex = *e++;
+  if (o_rex != e_rex) kinds |= 1 << ENC_REX;
+  if (insn->vex && o_end - o > 1 && *o == 0xc4
+      && ((o[1] & 0x1f) < 1 || (o[1] & 0x1f) > 3))
+    return kinds | 1 << ENC_VEX_MAP;
+  if ((insn->vex || insn->xop) && *o != 0xc5 && o_end - o > 1
+      && e_end - e > 1 && *o == *e && (o[1] ^ e[1]) == 0x40) {
+    copy[o + 1 - copy] = e[1];
+    kinds |= 1 << ENC_REX;
+  }
+
+  if (o_end - o == e_end - e && !__builtin_memcmp(o, e, o_end - o))
+    return kinds;
+  if (insn->addr == XV_ADDR_REG) return kinds | 1 << ENC_OTHER;
+
+  xv_x64_const_i *const o_modrm = skip_opcode(insn, o);
+  xv_x64_const_i *const e_modrm = skip_opcode(insn, e);
+  if (o_modrm >= o_end || e_modrm >= e_end || o_modrm - o != e_modrm - e
+      || __builtin_memcmp(o, e, o_modrm - o)
+      || (*o_modrm & 0x38) != (*e_modrm & 0x38))
+    return kinds | 1 << ENC_OTHER;
+
+  int            const o_sib  = *o_modrm >> 6 != 3 && (*o_modrm & 7) == 4;
+  int            const e_sib  = *e_modrm >> 6 != 3 && (*e_modrm & 7) == 4;
+  xv_x64_const_i const o_byte = o_sib ? o_modrm[1] : 0;
+  xv_x64_const_i const e_byte = e_sib ? e_modrm[1] : 0;
+  if (o_sib != e_sib || o_byte != e_byte) kinds |= 1 << ENC_SIB;
+
+  unsigned const o_disp = disp_size(*o_modrm, o_byte);
+  unsigned const e_disp = disp_size(*e_modrm, e_byte);
+  if (*o_modrm >> 6 != *e_modrm >> 6 || o_disp != e_disp)
+    kinds |= 1 << ENC_DISP;
+
+  /* The fields say the displacements are equal, so what's left is the
+   * immediate, which has to match. */
+  xv_x64_const_i *const o_imm = o_modrm + 1 + o_sib + o_disp;
+  xv_x64_const_i *const e_imm = e_modrm + 1 + e_sib + e_disp;
+  if (o_end - o_imm != e_end - e_imm
+      || __builtin_memcmp(o_imm, e_imm, o_end - o_imm)
+      || !(kinds & (1 << ENC_SIB | 1 << ENC_DISP)))
+    kinds |= 1 << ENC_OTHER;
+  return kinds;
+}
+
+static xv_x64_const_i *find_text(xv_x64_const_i *const file,
+                                 ssize_t         const size,
+                                 ssize_t        *const text_size) {
+  Elf64_Ehdr const *const ehdr = (Elf64_Ehdr const*) file;
+  if (size < sizeof(Elf64_Ehdr)
+      || __builtin_memcmp(ehdr->e_ident, ELFMAG, SELFMAG)
+      || ehdr->e_ident[EI_CLASS] != ELFCLASS64
+      || ehdr->e_shoff + ehdr->e_shnum * sizeof(Elf64_Shdr) > size)
+    return NULL;
+
+  Elf64_Shdr const *const shdrs   = (Elf64_Shdr const*) (file + ehdr->e_shoff);
+  char       const *const strings = (char const*)
+                                    (file + shdrs[ehdr->e_shstrndx].sh_offset);
+
+  for (unsigned i = 0; i < ehdr->e_shnum; ++i)
+    if (!__builtin_strcmp(strings + shdrs[i].sh_name, ".text")
+        && shdrs[i].sh_offset + shdrs[i].sh_size <= size) {
+      *text_size = shdrs[i].sh_size;
+      return file + shdrs[i].sh_offset;
+    }
+  return NULL;
+}
+
+static int bench(char const *const path) {
+  int const fd = open(path, O_RDONLY);
+  struct stat s;
+  if (fd == -1 || fstat(fd, &s)) {
+    printf("%s: can't open\n", path);
+    return 1;
+  }
+
+  xv_x64_const_i *const file = mmap(NULL, s.st_size, PROT_READ, MAP_PRIVATE,
+                                    fd, 0);
+  ssize_t               size;
+  xv_x64_const_i *const text = file == MAP_FAILED
+                             ? NULL : find_text(file, s.st_size, &size);
+  if (!text) {
+    printf("%s: no .text section\n", path);
+    return 1;
+  }
+
+  xv_x64_scan_entry *const entries = malloc(size * sizeof(*entries));
+  xv_x64_insn       *const insns   = malloc(size * sizeof(*insns));
+  ssize_t            const room    = size * 3 + 16;
+  xv_x64_i          *const out     = malloc(room);
+  unsigned long n = 0, scanned = 0, exact = 0, rewritten = 0, mismatches = 0;
+  unsigned long kinds[ENC_KINDS] = { 0 };
+  double        t, best;
+
+  printf("%s: %ld bytes of .text\n", path, (long) size);
+
+  /* xv_x64_scan, the bulk boundary finder */
+  best = 1e9;
+  for (int r = 0; r < ROUNDS; ++r) {
+    xv_x64_const_ibuffer buf = { text, text, text, size };
+    scanned = 0;
+    t = now();
+    while (buf.current < buf.start + buf.capacity) {
+      scanned += xv_x64_scan(&buf, entries + scanned, size - scanned);
+      if (buf.current < buf.start + buf.capacity) ++buf.current;
+    }
+    if ((t = now() - t) < best) best = t;
+  }
+  report("scan", scanned, best);
+
+  /* xv_x64_read_insn */
+  best = 1e9;
+  for (int r = 0; r < ROUNDS; ++r) {
+    xv_x64_const_ibuffer buf = { text, text, text, size };
+    n = 0;
+    t = now();
+    while (buf.current < buf.start + buf.capacity)
+      if (xv_x64_read_insn(&buf, &insns[n])) ++buf.current;
+      else                                   ++n;
+    if ((t = now() - t) < best) best = t;
+  }
+  report("read", n, best);
+
+  /* xv_x64_write_insn, from the instructions we just decoded */
+  best = 1e9;
+  for (int r = 0; r < ROUNDS; ++r) {
+    xv_x64_ibuffer buf = { text, out, out, room };
+    t = now();
+    for (unsigned long i = 0; i < n; ++i)
+      xv_x64_write_insn(&buf, &insns[i]);
+    if ((t = now() - t) < best) best = t;
+  }
+  report("write", n, best);
+
+  for (unsigned long i = 0; i < n; ++i) {
+    xv_x64_ibuffer buf = { text, out, out, 16 };
+    ssize_t const length = insns[i].rip - insns[i].start;
+    if (xv_x64_write_insn(&buf, &insns[i])) {
+      check_insn("write", &insns[i], insns[i].start, insns[i].start, out, out,
+                 &mismatches);
+      continue;
+    }
+    if (check_insn("write", &insns[i], insns[i].start, insns[i].start, out,
+                   buf.current, &mismatches))
+      continue;
+    if (buf.current - out == length
+        && !__builtin_memcmp(out, insns[i].start, length)) {
+      ++exact;
+      continue;
+    }
+
+    unsigned const differences =
+      encoding_differences(&insns[i], out, buf.current);
+    for (int k = 0; k < ENC_KINDS; ++k) kinds[k] += differences >> k & 1;
+    if (differences & 1 << ENC_OTHER && kinds[ENC_OTHER] <= 5) {
+      printf("  re-encoding differs:");
+      for (xv_x64_const_i *c = insns[i].start;
+           c < (xv_x64_const_i*) insns[i].start + length; ++c)
+        printf(" %02x", *c);
+      printf(" ->");
+      for (xv_x64_const_i *c = out; c < buf.current; ++c) printf(" %02x", *c);
+      printf("\n");
+    }
+  }
+
+  printf("  round trip: %lu of %lu instructions re-encode byte-exact; "
+         "the others have\n", exact, n);
+  for (int k = 0; k < ENC_KINDS; ++k)
+    printf("    %8lu %s\n", kinds[k], encoding_kinds[k]);
+
+  /* xv_x64_step_rw, relocating everything into a buffer that the original
+   * code is pretending to live in */
+  ssize_t length = 0;
+  best = 1e9;
+  for (int r = 0; r < ROUNDS; ++r) {
+    xv_x64_rewriter rw = { { out, text, text, size },
+                           { out, out, out, room } };
+    rewritten = 0;
+    t = now();
+    while (rw.src.current < rw.src.start + rw.src.capacity)
+      if (xv_x64_step_rw(&rw)) *rw.dst.current++ = *rw.src.current++;
+      else                     ++rewritten;
+    if ((t = now() - t) < best) best = t;
+    length = rw.dst.current - rw.dst.start;
+  }
+  report("rewrite", rewritten, best);
+  printf("  rewritten .text is %ld bytes (%+.1f%%)\n", (long) length,
+         100.0 * (length - size) / size);
+
+  /* Once more, decoding each rewritten instruction next to its original.
+   * The relocator promotes every short branch to rel32, so those aren't
+   * byte-exact by design; we just count them. */
+  unsigned long   promoted = 0;
+  xv_x64_rewriter rw = { { out, text, text, size },
+                         { out, out, out, room } };
+  while (rw.src.current < rw.src.start + rw.src.capacity) {
+    xv_x64_const_ibuffer       src    = rw.src;
+    xv_x64_const_i     *const  source = rw.src.current;
+    xv_x64_i           *const  at     = rw.dst.current;
+    xv_x64_insn                original;
+    if (xv_x64_step_rw(&rw)) *rw.dst.current++ = *rw.src.current++;
+    else if (!xv_x64_read_insn(&src, &original)) {
+      check_insn("rewrite", &original, source, at, at, rw.dst.current,
+                 &mismatches);
+      promoted += short_branchp(&original)
+               && rw.dst.current - at > rw.src.current - source;
+    }
+  }
+  printf("  %lu rel8 branches promoted to rel32\n", promoted);
+
+  printf("  %lu instructions decode differently after a round trip\n",
+         mismatches);
+
+  free(entries);
+  free(insns);
+  free(out);
+  munmap((void*) file, s.st_size);
+  close(fd);
+  return mismatches || kinds[ENC_OTHER];
+}
+
+int main(int const argc, char const *const *const argv) {
+  int failures = 0;
+  xv_x64_scan_init();
+  for (int i = 1; i < argc; ++i) failures += bench(argv[i]);
+  return !!failures;
+}
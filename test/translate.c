@@ -0,0 +1,770 @@
+#include "../build/xv.h"
+#include "../build/xv-x64.h"
+#include "../build/xv-virt.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/futex.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+/* Runs some functions through the translation cache and checks that they
+ * compute the same things natively and translated. The functions live in
+ * their own section so that the cached region covers only them. The caches
+ * set native_escape, so that their callers (and anything they return to) run
+ * natively. */
+#define subject __attribute__((section("xv_subject"), noinline))
+
+extern xv_x64_const_i __start_xv_subject[];
+extern xv_x64_const_i __stop_xv_subject[];
+extern char           __executable_start[];
+
+static long counter;
+
+subject long sum_to(long n) {
+  long total = 0;
+  for (long i = 0; i < n; ++i) total += i;
+  return total;
+}
+
+subject long fib(long n) {
+  return n < 2 ? n : fib(n - 1) + fib(n - 2);
+}
+
+subject long collatz(long n) {
+  long steps = 0;
+  while (n != 1) n = n & 1 ? 3 * n + 1 : n / 2, ++steps;
+  return steps;
+}
+
+subject long bump(long n) {
+  counter = 0;
+  for (long i = 0; i < n; ++i) counter += i & 3;
+  return counter;
+}
+
+subject long classify(long n) {
+  switch (n % 7) {
+    case 0:  return 10;
+    case 1:  return 21;
+    case 2:  return 32;
+    case 3:  return 43;
+    case 4:  return 54;
+    case 5:  return 65;
+    default: return 76;
+  }
+}
+
+subject long sum_classes(long n) {
+  long total = 0;
+  for (long i = 0; i < n; ++i) total += classify(i);
+  return total;
+}
+
+subject long twice(long (*const f)(long), long const x) {
+  return f(f(x));
+}
+
+subject long fib_twice(long n) {
+  return twice(fib, n);
+}
+
+subject long add3(long x) { return x + 3; }
+subject long mul3(long x) { return x * 3; }
+subject long xor5(long x) { return x ^ 0x55; }
+
+static long (*const ops[])(long) = { add3, mul3, xor5 };
+
+subject long call_ops(long n) {
+  long x = 1;
+  for (long i = 0; i < n; ++i) x = ops[i % 3](x) & 0xffffff;
+  return x;
+}
+
+/* Not a subject: translated code calls out to it, and it has to return into
+ * translated code. */
+static void const *native_return;
+
+static __attribute__((noinline)) long native_add1(long const x) {
+  native_return = __builtin_return_address(0);
+  return x + 1;
+}
+
+subject long call_native(long x) {
+  return native_add1(x) * 2;
+}
+
+subject long call_native_twice(long x) {
+  return twice(native_add1, x);
+}
+
+/* A far return can't be translated, so entering here has to trap. */
+asm (".pushsection xv_subject, \"ax\", @progbits\n"
+     "far_return: lretq\n"
+     ".popsection\n");
+
+/* Nor can anything that uses %gs, which is xv's. */
+asm (".pushsection xv_subject, \"ax\", @progbits\n"
+     "gs_load: mov %gs:0, %rax\n"
+     "  ret\n"
+     ".popsection\n");
+
+extern xv_x64_const_i far_return[];
+extern xv_x64_const_i gs_load[];
+
+static char page[4096] __attribute__((aligned(4096)));
+
+subject long sys3(long const nr, long const a, long const b,
+                  long const c) {
+  long result;
+  asm volatile ("syscall" : "=a"(result)
+                          : "a"(nr), "D"(a), "S"(b), "d"(c)
+                          : "rcx", "r11", "memory");
+  return result;
+}
+
+/* getpid runs inline, mprotect goes to the handler and then runs inline, and
+ * the handler answers getppid itself. */
+subject long syscalls(long n) {
+  long total = 0;
+  for (long i = 0; i < n; ++i)
+    total += sys3(__NR_getpid, 0, 0, 0)
+           + sys3(__NR_mprotect, (long) page, sizeof(page),
+                  PROT_READ | PROT_WRITE)
+           + sys3(__NR_getppid, 0, 0, 0);
+  return total;
+}
+
+/* i386 syscalls always go to the handler, which answers this one itself. */
+subject long int80(long nr) {
+  long result;
+  asm volatile ("int $0x80" : "=a"(result) : "a"(nr) : "memory");
+  return result;
+}
+
+/* spawn(stack, tid) starts a thread the way pthread_create does, with a raw
+ * clone. The child pops a function and its argument off the stack it was
+ * given, calls the function, stores the result in spawn_result, and exits;
+ * the kernel clears *tid when it's gone. */
+int  spawn_tid;
+long spawn_result;
+
+asm (".pushsection xv_subject, \"ax\", @progbits\n"
+     "spawn:\n"
+     "  mov %rsi, %r10\n"
+     "  mov %rdi, %rsi\n"
+     "  mov $0x250f00, %edi\n"     /* VM, FS, FILES, SIGHAND, THREAD, SYSVSEM,
+                                     CHILD_CLEARTID */
+     "  xor %edx, %edx\n"
+     "  xor %r8d, %r8d\n"
+     "  mov $56, %eax\n"           /* __NR_clone */
+     "  syscall\n"
+     "  test %rax, %rax\n"
+     "  jz 1f\n"
+     "  ret\n"
+     "1:\n"
+     "  pop %rax\n"
+     "  pop %rdi\n"
+     "  call *%rax\n"
+     "  mov %rax, spawn_result(%rip)\n"
+     "  xor %edi, %edi\n"
+     "  mov $60, %eax\n"           /* __NR_exit */
+     "  syscall\n"
+     ".popsection\n");
+
+extern xv_x64_const_i spawn[];
+
+static long intercepted;
+
+static int count_syscall(xv_x64_tcache     *const tc,
+                         xv_x64_exit_frame *const frame,
+                         int                const abi) {
+  if (abi == XV_X64_ABI_32) {
+    frame->rax += 1000;
+    return XV_X64_SYSCALL_DONE;
+  }
+  ++intercepted;
+  if (frame->rax != __NR_getppid) return XV_X64_SYSCALL_NATIVE;
+  frame->rax = getppid();
+  return XV_X64_SYSCALL_DONE;
+}
+
+typedef long (*subject_fn)(long);
+
+#define THREADS 4
+
+static int check(xv_x64_tcache *const tc,
+                 char const    *const name,
+                 subject_fn     const f,
+                 long           const x) {
+  subject_fn const translated = (subject_fn) xv_x64_tcache_enter(tc, f);
+  long       const expected   = f(x);
+  long       const actual     = translated(x);
+
+  printf("%s %s(%ld) = %ld (expected %ld)\n",
+         actual == expected ? "ok  " : "FAIL", name, x, actual, expected);
+  return actual != expected;
+}
+
+/* Each thread runs everything through its own cache, picking up whatever the
+ * others have already translated. */
+static void *run_thread(void *const arg) {
+  xv_x64_tcache *const tc = arg;
+  long failures = 0;
+  for (int i = 0; i < 20; ++i) {
+    failures += check(tc, "fib",         fib,         15);
+    failures += check(tc, "sum_classes", sum_classes, 1000);
+    failures += check(tc, "call_ops",    call_ops,    1000);
+    failures += check(tc, "fib_twice",   fib_twice,   8);
+  }
+  return (void*) failures;
+}
+
+static int check_threads(void) {
+  xv_x64_tcache root, caches[THREADS];
+  pthread_t     threads[THREADS];
+  long          failures = 0;
+  int           status;
+
+  if (status = xv_x64_tcache_init(&root, __start_xv_subject,
+                                  __stop_xv_subject - __start_xv_subject,
+                                  1 << 20, 4096, THREADS + 2)) {
+    printf("xv_x64_tcache_init failed: %d\n", status);
+    return 1;
+  }
+  root.native_escape = 1;
+  root.trace_threshold = 50;
+
+  for (int i = 0; i < THREADS; ++i)
+    if (status = xv_x64_tcache_init_thread(&caches[i], &root, 1 << 20,
+                                           4096)) {
+      printf("xv_x64_tcache_init_thread failed: %d\n", status);
+      return 1;
+    }
+
+  for (int i = 0; i < THREADS; ++i)
+    pthread_create(&threads[i], NULL, run_thread, &caches[i]);
+  for (int i = 0; i < THREADS; ++i) {
+    void *result;
+    pthread_join(threads[i], &result);
+    failures += (long) result;
+  }
+
+  unsigned blocks = 0;
+  for (int i = 0; i < THREADS; ++i) blocks += caches[i].nblocks;
+  printf("%s %u blocks in %d thread caches, %u table slots\n",
+         root.map->caches == THREADS + 1 ? "ok  " : "FAIL",
+         blocks, THREADS, root.map->count);
+  failures += root.map->caches != THREADS + 1;
+
+  /* A full cache in a group traps rather than flushing the others'
+   * translations; once xv has made room, entering again works. Each subject's
+   * first block is a new one after the flush. */
+  subject_fn const firsts[] = { sum_to, fib, collatz, bump, classify };
+  xv_x64_tcache    full, huge;
+  void const      *code = NULL;
+  unsigned         n    = 0;
+
+  xv_x64_tcache_flush(&root);
+  if (status = xv_x64_tcache_init_thread(&full, &root, 1 << 20, 4)) {
+    printf("xv_x64_tcache_init_thread failed: %d\n", status);
+    return 1;
+  }
+  while (n < sizeof(firsts) / sizeof(*firsts)
+         && (code = xv_x64_tcache_enter(&full, firsts[n]))
+            != xv_x64_untranslatable)
+    ++n;
+  printf("%s full group cache traps after %u blocks: status %d\n",
+         n == 4 && full.shared->thread.trap_status == XV_TC_FULL
+           ? "ok  " : "FAIL",
+         n, full.shared->thread.trap_status);
+  failures += n != 4 || full.shared->thread.trap_status != XV_TC_FULL;
+
+  xv_x64_tcache_flush(&full);
+  code = xv_x64_tcache_enter(&full, full.shared->thread.trap);
+  printf("%s entering again after a flush\n",
+         code != xv_x64_untranslatable ? "ok  " : "FAIL");
+  failures += code == xv_x64_untranslatable;
+  xv_x64_tcache_free(&full);
+
+  status = xv_x64_tcache_init_thread(&huge, &root, 1 << 20, 1 << 16);
+  printf("%s cache too big for the group's table: %d (expected %d)\n",
+         status == -ENOSPC ? "ok  " : "FAIL", status, -ENOSPC);
+  failures += status != -ENOSPC;
+
+  for (int i = 0; i < THREADS; ++i) xv_x64_tcache_free(&caches[i]);
+  xv_x64_tcache_free(&root);
+  return failures != 0;
+}
+
+/* A translated clone gets its own cache, and the next one reuses it once the
+ * first thread has exited. */
+static int check_clone(void) {
+  static long   stack[4096] __attribute__((aligned(16)));
+  xv_x64_tcache root;
+  int           failures = 0;
+  int           status;
+
+  if (status = xv_x64_tcache_init(&root, __start_xv_subject,
+                                  __stop_xv_subject - __start_xv_subject,
+                                  1 << 20, 4096, 3)) {
+    printf("xv_x64_tcache_init failed: %d\n", status);
+    return 1;
+  }
+  root.native_escape = 1;
+
+  for (int i = 0; i < 2; ++i) {
+    long (*const translated)(long *, int *) =
+      xv_x64_tcache_enter(&root, spawn);
+    long *const top = &stack[4096 - 4];
+    top[0] = (long) fib;
+    top[1] = 15;
+    spawn_result = 0;
+    __atomic_store_n(&spawn_tid, 1, __ATOMIC_RELAXED);
+
+    long const tid = translated(top, &spawn_tid);
+    for (int t; tid > 0 && (t = __atomic_load_n(&spawn_tid, __ATOMIC_ACQUIRE));)
+      syscall(__NR_futex, &spawn_tid, FUTEX_WAIT, t, NULL, NULL, 0);
+
+    xv_x64_tcache *const child = root.next;
+    printf("%s clone %d: fib(15) = %ld in a thread, %u caches, "
+           "%u blocks in the child's\n",
+           tid > 0 && spawn_result == 610 && root.map->caches == 2
+             && child->spawned && child->nblocks ? "ok  " : "FAIL",
+           i, spawn_result, root.map->caches, child->nblocks);
+    failures += tid <= 0 || spawn_result != 610 || root.map->caches != 2
+             || !child->spawned || !child->nblocks;
+  }
+
+  /* The program can't use %gs. */
+  xv_x64_tcache *const child = root.next;
+  void const    *const trap  = xv_x64_tcache_enter(&root, gs_load);
+  printf("%s %%gs load traps: status %d (expected %d)\n",
+         trap == xv_x64_untranslatable
+           && root.shared->thread.trap_status == XV_TC_SEGMENT
+           ? "ok  " : "FAIL",
+         root.shared->thread.trap_status, XV_TC_SEGMENT);
+  failures += trap != xv_x64_untranslatable
+           || root.shared->thread.trap_status != XV_TC_SEGMENT;
+
+  xv_x64_tcache_free(child);
+  munmap(child, sizeof(xv_x64_tcache));
+  xv_x64_tcache_free(&root);
+  return failures;
+}
+
+/* Not a subject: each of check_many_clones' threads waits here until they've
+ * all started. */
+static int held, released;
+
+static __attribute__((noinline)) long hold(void) {
+  __atomic_add_fetch(&held, 1, __ATOMIC_RELEASE);
+  while (!__atomic_load_n(&released, __ATOMIC_ACQUIRE))
+    syscall(__NR_futex, &released, FUTEX_WAIT, 0, NULL, NULL, 0);
+  return 0;
+}
+
+subject long held_fib(long x) {
+  return hold() + fib(x);
+}
+
+#define CLONES 6
+
+/* A group sized for two caches still gives every clone one, with all of the
+ * threads running at once. */
+static int check_many_clones(void) {
+  static long   stacks[CLONES][1024] __attribute__((aligned(16)));
+  static int    tids[CLONES];
+  xv_x64_tcache root;
+  long          tid[CLONES];
+  int           started  = 0;
+  int           failures = 0;
+  int           status;
+
+  if (status = xv_x64_tcache_init(&root, __start_xv_subject,
+                                  __stop_xv_subject - __start_xv_subject,
+                                  1 << 20, 4096, 2)) {
+    printf("xv_x64_tcache_init failed: %d\n", status);
+    return 1;
+  }
+  root.native_escape = 1;
+
+  long (*const translated)(long *, int *) = xv_x64_tcache_enter(&root, spawn);
+  spawn_result = 0;
+  for (int i = 0; i < CLONES; ++i) {
+    long *const top = &stacks[i][1024 - 4];
+    top[0]  = (long) held_fib;
+    top[1]  = 15;
+    tids[i] = 1;
+    started += (tid[i] = translated(top, &tids[i])) > 0;
+  }
+
+  while (__atomic_load_n(&held, __ATOMIC_ACQUIRE) < started) sched_yield();
+  __atomic_store_n(&released, 1, __ATOMIC_RELEASE);
+  syscall(__NR_futex, &released, FUTEX_WAKE, CLONES, NULL, NULL, 0);
+  for (int i = 0; i < CLONES; ++i)
+    for (int t; tid[i] > 0 && (t = __atomic_load_n(&tids[i],
+                                                   __ATOMIC_ACQUIRE));)
+      syscall(__NR_futex, &tids[i], FUTEX_WAIT, t, NULL, NULL, 0);
+
+  unsigned exited = 0;
+  for (xv_x64_tcache *c = root.next; c != &root; c = c->next)
+    exited += c->spawned && c->shared->thread.exited;
+  printf("%s %d clones into a group sized for 2: %d started, %u caches, "
+         "%u exited\n",
+         started == CLONES && root.map->caches == CLONES + 1
+           && exited == CLONES && spawn_result == 610 ? "ok  " : "FAIL",
+         CLONES, started, root.map->caches, exited);
+  failures += started != CLONES || root.map->caches != CLONES + 1
+           || exited != CLONES || spawn_result != 610;
+
+  while (root.next != &root) {
+    xv_x64_tcache *const c = root.next;
+    xv_x64_tcache_free(c);
+    munmap(c, sizeof(xv_x64_tcache));
+  }
+  xv_x64_tcache_free(&root);
+  return failures;
+}
+
+static unsigned basic_blocks(xv_x64_tcache const *const tc) {
+  unsigned n = 0;
+  for (unsigned i = 0; i < tc->nblocks; ++i)
+    n += tc->blocks[i].code && tc->blocks[i].length == 1;
+  return n;
+}
+
+static int run_image_subjects(xv_x64_tcache *const tc) {
+  int failures = 0;
+  failures += check(tc, "sum_to",      sum_to,      100000);
+  failures += check(tc, "sum_classes", sum_classes, 1000);
+  failures += check(tc, "call_ops",    call_ops,    100000);
+  failures += check(tc, "fib_twice",   fib_twice,   8);
+  return failures;
+}
+
+/* Images get replaced, never rewritten, since a cache that loaded one has
+ * its code mapped from the file (see xv_virt_save). */
+static int save_image(xv_x64_tcache *const tc,
+                      char const    *const dir,
+                      uint8_t const *const key) {
+  char tmp[64], path[64];
+  snprintf(tmp,  sizeof(tmp),  "%s/image.tmp", dir);
+  snprintf(path, sizeof(path), "%s/image",     dir);
+
+  int const fd = open(tmp, O_CREAT | O_TRUNC | O_WRONLY, 0600);
+  if (fd < 0) return -errno;
+  int const status = xv_x64_tcache_save(tc, fd, key);
+  close(fd);
+  return status ? status : rename(tmp, path) ? -errno : 0;
+}
+
+/* A cache loaded from an image runs the same code without translating any of
+ * it again. The first cache is still there when the second one is made, so
+ * the second one's arena is somewhere else and the image has to relocate.
+ * Saving a new image over the loaded one doesn't disturb it. */
+static int check_image(void) {
+  xv_x64_tcache cold, warm;
+  uint8_t       key[XV_X64_IMAGE_KEY], other[XV_X64_IMAGE_KEY];
+  char          dir[]    = "/tmp/xv-image-XXXXXX";
+  char          path[64];
+  int           failures = 0;
+  int           status;
+  unsigned      id       = 0;
+
+  if (!mkdtemp(dir)) {
+    printf("mkdtemp failed: %d\n", errno);
+    return 1;
+  }
+  snprintf(path, sizeof(path), "%s/image", dir);
+
+  xv_virt_image_key((Elf64_Ehdr const*) __executable_start, 1, 2, key);
+  for (int i = 16; i < XV_X64_IMAGE_KEY; ++i) id |= key[i];
+  printf("%s build-id in image key\n", id ? "ok  " : "FAIL");
+  failures += !id;
+
+  if (status = xv_x64_tcache_init(&cold, __start_xv_subject,
+                                  __stop_xv_subject - __start_xv_subject,
+                                  1 << 20, 4096, 1)) {
+    printf("xv_x64_tcache_init failed: %d\n", status);
+    return 1;
+  }
+  cold.native_escape = 1;
+  cold.trace_threshold = 50;
+  failures += run_image_subjects(&cold);
+
+  unsigned const blocks = cold.nblocks, basic = basic_blocks(&cold);
+  status = save_image(&cold, dir, key);
+  printf("%s saved %u blocks: %d\n", status ? "FAIL" : "ok  ", blocks,
+         status);
+  failures += !!status;
+  int const file = open(path, O_RDONLY);
+
+  if (status = xv_x64_tcache_init(&warm, __start_xv_subject,
+                                  __stop_xv_subject - __start_xv_subject,
+                                  1 << 20, 4096, 1)) {
+    printf("xv_x64_tcache_init failed: %d\n", status);
+    return 1;
+  }
+  warm.native_escape = 1;
+  warm.trace_threshold = 50;
+
+  memcpy(other, key, sizeof(key));
+  other[16] ^= 1;
+  status = xv_x64_tcache_load(&warm, file, other);
+  printf("%s load with another key: %d (expected 1)\n",
+         status == 1 ? "ok  " : "FAIL", status);
+  failures += status != 1;
+
+  /* An exit record that points outside the image's code makes the whole
+   * image unusable. */
+  FILE *const bad    = tmpfile();
+  long  const length = lseek(file, 0, SEEK_END);
+  char *const bytes  = malloc(length);
+  pread(file, bytes, length, 0);
+  ((xv_x64_block*) (bytes + sizeof(xv_x64_image)))->exits[0].quads =
+    (void const**) 8;
+  fwrite(bytes, 1, length, bad);
+  fflush(bad);
+  status = xv_x64_tcache_load(&warm, fileno(bad), key);
+  printf("%s load with a bad exit record: %d (expected 1), %u blocks\n",
+         status == 1 && !warm.nblocks ? "ok  " : "FAIL", status,
+         warm.nblocks);
+  failures += status != 1 || warm.nblocks;
+  free(bytes);
+  fclose(bad);
+
+  status = xv_x64_tcache_load(&warm, file, key);
+  printf("%s load: %d, %u of %u blocks, %u relocations, arena moved %+ld\n",
+         !status && warm.nblocks == blocks ? "ok  " : "FAIL", status,
+         warm.nblocks, blocks, warm.nrelocs,
+         (long) (warm.rw.dst.start - cold.rw.dst.start));
+  failures += status || warm.nblocks != blocks
+           || warm.rw.dst.start == cold.rw.dst.start;
+  close(file);
+
+  xv_x64_tcache_flush(&cold);
+  status = save_image(&cold, dir, key);
+  printf("%s saved an empty image over the loaded one: %d\n",
+         status ? "FAIL" : "ok  ", status);
+  failures += !!status;
+  xv_x64_tcache_free(&cold);
+
+  failures += run_image_subjects(&warm);
+  printf("%s %u basic blocks after running (expected %u)\n",
+         basic_blocks(&warm) == basic ? "ok  " : "FAIL",
+         basic_blocks(&warm), basic);
+  failures += basic_blocks(&warm) != basic;
+
+  xv_x64_tcache_free(&warm);
+  unlink(path);
+  rmdir(dir);
+  return failures;
+}
+
+/* The subject section is all code, so a linear sweep with xv_x64_scan should
+ * find exactly the same instructions as xv_x64_read_insn. */
+static int check_scan(void) {
+  xv_x64_const_ibuffer scan = { __start_xv_subject, __start_xv_subject,
+                                __start_xv_subject,
+                                __stop_xv_subject - __start_xv_subject };
+  xv_x64_const_ibuffer read = scan;
+  xv_x64_scan_entry    entries[4096];
+  xv_x64_insn          insn;
+  unsigned const       n = xv_x64_scan(&scan, entries, 4096);
+  unsigned             i = 0;
+
+  for (; i < n && !xv_x64_read_insn(&read, &insn); ++i)
+    if (entries[i].length != insn.rip - insn.start) break;
+
+  printf("%s scan: %u of %u instructions agree with read_insn\n",
+         i == n && scan.current == read.current ? "ok  " : "FAIL", i, n);
+  return i != n || scan.current != read.current;
+}
+
+static int check_return(xv_x64_tcache const *const tc,
+                        char const          *const name) {
+  xv_x64_const_i *const r  = native_return;
+  int             const ok = r >= tc->rw.dst.start && r < tc->rw.dst.current;
+  printf("%s %s returned into translated code: %p\n",
+         ok ? "ok  " : "FAIL", name, r);
+  return !ok;
+}
+
+/* Without native_escape, leaving the region traps like anything else we
+ * can't translate. With it, native code that translated code calls returns
+ * into translated code, whether the call was direct or through a pointer. */
+static int check_native(xv_x64_tcache *const tc) {
+  int failures = 0;
+
+  tc->native_escape = 0;
+  void const *const trap = xv_x64_tcache_enter(tc, native_add1);
+  printf("%s leaving the region traps: status %d (expected %d)\n",
+         trap == xv_x64_untranslatable
+           && tc->shared->thread.trap_status == XV_TC_RANGE ? "ok  " : "FAIL",
+         tc->shared->thread.trap_status, XV_TC_RANGE);
+  failures += trap != xv_x64_untranslatable
+           || tc->shared->thread.trap_status != XV_TC_RANGE;
+  tc->native_escape = 1;
+
+  failures += check(tc, "call_native", call_native, 20);
+  failures += check_return(tc, "call_native");
+  failures += check(tc, "call_native_twice", call_native_twice, 20);
+  failures += check_return(tc, "call_native_twice");
+  return failures;
+}
+
+int main() {
+  xv_x64_tcache tc;
+  int status = xv_x64_tcache_init(&tc, __start_xv_subject,
+                                  __stop_xv_subject - __start_xv_subject,
+                                  1 << 20, 4096, 1);
+  if (status) {
+    printf("xv_x64_tcache_init failed: %d\n", status);
+    return 1;
+  }
+  tc.native_escape = 1;
+
+  int failures = check_scan();
+
+  /* An ibuffer that hasn't been allocated yet is full, not a sizing buffer. */
+  xv_x64_ibuffer    empty = { 0 };
+  xv_x64_insn const nop   = { .opcode = 0x90 };
+  status = xv_x64_write_insn(&empty, &nop);
+  printf("%s write into an empty ibuffer: %d (expected %d)\n",
+         status == XV_WR_END ? "ok  " : "FAIL", status, XV_WR_END);
+  failures += status != XV_WR_END;
+  failures += check(&tc, "sum_to",      sum_to,      100000);
+  failures += check(&tc, "fib",         fib,         20);
+  failures += check(&tc, "collatz",     collatz,     837799);
+  failures += check(&tc, "bump",        bump,        1000);
+  failures += check(&tc, "sum_classes", sum_classes, 1000);
+  failures += check(&tc, "fib_twice",   fib_twice,   8);
+  failures += check(&tc, "call_ops",    call_ops,    100000);
+
+  void const *const trap = xv_x64_tcache_enter(&tc, far_return);
+  printf("%s far_return traps: %p, status %d\n",
+         trap == xv_x64_untranslatable && tc.shared->thread.trap == far_return
+           ? "ok  " : "FAIL",
+         trap, tc.shared->thread.trap_status);
+  failures += trap != xv_x64_untranslatable
+           || tc.shared->thread.trap != far_return;
+  failures += check_native(&tc);
+
+  tc.syscall_handler = count_syscall;
+  xv_x64_tcache_intercept(&tc, __NR_getppid, 1);
+  failures += check(&tc, "syscalls",    syscalls,    1000);
+  printf("%s %ld syscalls intercepted (expected 2000)\n",
+         intercepted == 2000 ? "ok  " : "FAIL", intercepted);
+  failures += intercepted != 2000;
+
+  xv_x64_stats stats;
+  xv_x64_tcache_stats(&tc, &stats);
+  printf("%s counted %lu syscalls, %lu intercepted (expected 3000, 2000)\n",
+         stats.syscalls == 3000 && stats.intercepted == 2000 ? "ok  " : "FAIL",
+         (unsigned long) stats.syscalls, (unsigned long) stats.intercepted);
+  failures += stats.syscalls != 3000 || stats.intercepted != 2000;
+
+  /* Natively, this would be a real i386 getpid. */
+  long (*const translated_int80)(long) = xv_x64_tcache_enter(&tc, int80);
+  long const int80_result = translated_int80(20);
+  printf("%s int $0x80 went to the handler: %ld (expected 1020)\n",
+         int80_result == 1020 ? "ok  " : "FAIL", int80_result);
+  failures += int80_result != 1020;
+
+  printf("%u blocks, %ld bytes of translated code\n",
+         tc.nblocks, (long) (tc.rw.dst.current - tc.rw.dst.start));
+
+  /* One page isn't enough for everything, so this one has to flush as it
+   * goes. */
+  xv_x64_tcache small;
+  if (status = xv_x64_tcache_init(&small, __start_xv_subject,
+                                  __stop_xv_subject - __start_xv_subject,
+                                  4096, 4096, 1)) {
+    printf("xv_x64_tcache_init failed: %d\n", status);
+    return 1;
+  }
+  small.native_escape = 1;
+
+  for (int i = 0; i < 3; ++i) {
+    failures += check(&small, "sum_classes", sum_classes, 1000);
+    failures += check(&small, "call_ops",    call_ops,    1000);
+    failures += check(&small, "fib_twice",   fib_twice,   8);
+  }
+
+  printf("%u flushes with a one-page cache\n", small.flushes);
+  xv_x64_tcache_free(&small);
+
+  /* Count block executions and build traces for the hot paths. */
+  xv_x64_tcache traced;
+  if (status = xv_x64_tcache_init(&traced, __start_xv_subject,
+                                  __stop_xv_subject - __start_xv_subject,
+                                  1 << 20, 4096, 1)) {
+    printf("xv_x64_tcache_init failed: %d\n", status);
+    return 1;
+  }
+  traced.native_escape = 1;
+
+  traced.trace_threshold = 50;
+  failures += check(&traced, "sum_to",      sum_to,      100000);
+  failures += check(&traced, "collatz",     collatz,     837799);
+  failures += check(&traced, "sum_classes", sum_classes, 1000);
+  failures += check(&traced, "call_ops",    call_ops,    100000);
+  failures += check(&traced, "fib",         fib,         20);
+
+  unsigned traces = 0;
+  for (unsigned i = 0; i < traced.nblocks; ++i)
+    traces += traced.blocks[i].length > 1;
+  printf("%s %u traces in %u blocks\n", traces ? "ok  " : "FAIL",
+         traces, traced.nblocks);
+  failures += !traces;
+
+  /* Writing to translated code drops its translations and leaves the page
+   * writable until something on it is translated again. */
+  status = xv_x64_tcache_write_fault(&traced, (void const*) sum_to);
+  printf("%s write fault: %d, %u writable page(s)\n",
+         status == 1 && traced.map->nwritable == 1 ? "ok  " : "FAIL",
+         status, traced.map->nwritable);
+  failures += status != 1 || traced.map->nwritable != 1;
+  failures += check(&traced, "sum_to",      sum_to,      100000);
+  printf("%s %u writable pages after retranslating\n",
+         traced.map->nwritable ? "FAIL" : "ok  ", traced.map->nwritable);
+  failures += !!traced.map->nwritable;
+  xv_x64_tcache_free(&traced);
+
+  /* With counters, a full cache keeps its hot blocks instead of flushing. */
+  xv_x64_tcache bounded;
+  if (status = xv_x64_tcache_init(&bounded, __start_xv_subject,
+                                  __stop_xv_subject - __start_xv_subject,
+                                  4096, 4096, 1)) {
+    printf("xv_x64_tcache_init failed: %d\n", status);
+    return 1;
+  }
+  bounded.native_escape = 1;
+
+  bounded.trace_threshold = 20;
+  for (int i = 0; i < 3; ++i) {
+    failures += check(&bounded, "sum_classes", sum_classes, 1000);
+    failures += check(&bounded, "call_ops",    call_ops,    1000);
+    failures += check(&bounded, "collatz",     collatz,     837799);
+  }
+
+  printf("%s %u collections, %u flushes with a bounded cache\n",
+         bounded.collections ? "ok  " : "FAIL",
+         bounded.collections, bounded.flushes);
+  failures += !bounded.collections;
+  xv_x64_tcache_free(&bounded);
+
+  failures += check_threads();
+  failures += check_clone();
+  failures += check_many_clones();
+  failures += check_image();
+
+  xv_x64_tcache_free(&tc);
+  return !!failures;
+}